@@ -1310,6 +1310,19 @@ class Compiler
     Rule.touch("#{@tiles_dir}/COMPLETE", @source.tiles_rules)
   end
 
+  def tile_map_path
+    "#{@tilestack_dir}/r.tilemap"
+  end
+
+  # The pyramid's tiles are known up front, so the map is written before any tilestack, letting the
+  # subsampling rules' renders skip missing tiles too
+  def tile_map_rule
+    json = {"tiles" => @all_tiles.map {|tile| [tile.level, tile.x, tile.y]}}
+    path = "#{@tilestack_dir}/tiles-#{Process.pid}-#{Time.now.to_f}-#{rand(101010)}.json"
+    Filesystem.write_file(path, JSON.fast_generate(json))
+    Rule.add(tile_map_path, [], [tilestacktool_cmd + ['--write-tile-map', @tilestack_dir, path], ["rm", path]])
+  end
+
   def raw_tilestack_path(tile)
     "#{@raw_tilestack_dir}/#{tile.path}.ts2"
   end
@@ -1338,6 +1351,7 @@ class Compiler
     target = tilestack_path(target_idx)
     rule_dependencies = children.flat_map {|child| tilestack_rule(child, dependencies)}
     rule_dependencies << tilestack_path(metadata_tilestack)
+    rule_dependencies << tile_map_path
 
     cmd = tilestacktool_cmd
     cmd << "--create-parent-directories"
@@ -1426,8 +1440,10 @@ class Compiler
         # The source supplies tiles.  We should depend on these
         targets = all_tiles_rule
       end
+      # Let renderers skip missing tiles without probing the filesystem
+      tile_map = tile_map_rule
       targets = tilestack_rule(Tile.new(0,0,0), targets)
-      Rule.touch("#{@tilestack_dir}/COMPLETE", targets)
+      Rule.touch("#{@tilestack_dir}/COMPLETE", targets + tile_map)
     end
   end
 
@@ -0,0 +1,412 @@
+#include <assert.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <jpeglib.h>
+
+#include "cpp_utils.h"
+#include "marshal.h"
+#include "SimpleZlib.h"
+
+#include "FrameCodec.h"
+
+namespace {
+  const size_t band_header_size = 8;
+
+  void check_decoded_size(size_t actual, size_t expected) {
+    if (actual != expected) {
+      throw_error("FrameCodec: frame decoded to %ld bytes, but should have %ld bytes", (long) actual, (long) expected);
+    }
+  }
+
+  unsigned read_nbands(const unsigned char *src, size_t src_len) {
+    if (src_len < band_header_size) throw_error("FrameCodec: banded frame too short (%ld bytes)", (long) src_len);
+    unsigned nbands = read_u32((unsigned char*) src + 4);
+    if (src_len < band_header_size + 4 * (size_t) nbands) {
+      throw_error("FrameCodec: banded frame too short for %d bands", nbands);
+    }
+    return nbands;
+  }
+
+  // PNG row filters, applied bytewise with bpp = bytes per pixel
+  enum { FILTER_NONE = 0, FILTER_SUB = 1, FILTER_UP = 2, FILTER_AVERAGE = 3, FILTER_PAETH = 4, NFILTERS = 5 };
+
+  inline unsigned char paeth(unsigned char a, unsigned char b, unsigned char c) {
+    int p = (int) a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+  }
+
+  // Predicted value of byte i of row, given the previous row (NULL for the first row)
+  inline unsigned char predict(int filter, const unsigned char *row, const unsigned char *prev, size_t i, size_t bpp) {
+    unsigned char a = i >= bpp ? row[i - bpp] : 0;
+    unsigned char b = prev ? prev[i] : 0;
+    unsigned char c = (prev && i >= bpp) ? prev[i - bpp] : 0;
+    switch (filter) {
+    case FILTER_NONE:    return 0;
+    case FILTER_SUB:     return a;
+    case FILTER_UP:      return b;
+    case FILTER_AVERAGE: return (unsigned char) (((unsigned) a + b) / 2);
+    case FILTER_PAETH:   return paeth(a, b, c);
+    default: throw_error("FrameCodec: unknown row filter %d", filter);
+    }
+  }
+
+  // Filter each row with whichever predictor gives the smallest sum of absolute residuals, as libpng does
+  void filter_rows(std::vector<unsigned char> &dest, const unsigned char *pixels, const TilestackInfo &info) {
+    size_t bpp = info.bytes_per_pixel();
+    size_t bytes_per_row = bpp * info.tile_width;
+    dest.resize(info.tile_height * (1 + bytes_per_row));
+    std::vector<unsigned char> candidate(bytes_per_row);
+    for (unsigned y = 0; y < info.tile_height; y++) {
+      const unsigned char *row = pixels + y * bytes_per_row;
+      const unsigned char *prev = y ? row - bytes_per_row : NULL;
+      unsigned char *out = &dest[y * (1 + bytes_per_row)];
+      unsigned long best_cost = (unsigned long) -1;
+      for (int filter = 0; filter < NFILTERS; filter++) {
+        unsigned long cost = 0;
+        for (size_t i = 0; i < bytes_per_row; i++) {
+          candidate[i] = row[i] - predict(filter, row, prev, i, bpp);
+          cost += abs((signed char) candidate[i]);
+        }
+        if (cost < best_cost) {
+          best_cost = cost;
+          out[0] = filter;
+          if (bytes_per_row) memcpy(out + 1, &candidate[0], bytes_per_row);
+        }
+      }
+    }
+  }
+
+  void unfilter_rows(unsigned char *dest, const std::vector<unsigned char> &filtered, const TilestackInfo &info) {
+    size_t bpp = info.bytes_per_pixel();
+    size_t bytes_per_row = bpp * info.tile_width;
+    check_decoded_size(filtered.size(), info.tile_height * (1 + bytes_per_row));
+    for (unsigned y = 0; y < info.tile_height; y++) {
+      const unsigned char *in = &filtered[y * (1 + bytes_per_row)];
+      unsigned char *row = dest + y * bytes_per_row;
+      const unsigned char *prev = y ? row - bytes_per_row : NULL;
+      int filter = in[0];
+      for (size_t i = 0; i < bytes_per_row; i++) row[i] = in[1 + i] + predict(filter, row, prev, i, bpp);
+    }
+  }
+
+  const size_t delta_header_size = 8;
+
+  template <typename T>
+  void subtract_samples(unsigned char *dest, const unsigned char *a, const unsigned char *b, size_t nbytes) {
+    T *d = (T*) dest;
+    const T *x = (const T*) a, *y = (const T*) b;
+    for (size_t i = 0; i < nbytes / sizeof(T); i++) d[i] = (T) (x[i] - y[i]);
+  }
+
+  template <typename T>
+  void add_samples(unsigned char *dest, const unsigned char *b, size_t nbytes) {
+    T *d = (T*) dest;
+    const T *y = (const T*) b;
+    for (size_t i = 0; i < nbytes / sizeof(T); i++) d[i] = (T) (d[i] + y[i]);
+  }
+
+  // dest = a - b, or dest += b when a is NULL, per sample of bits_per_band
+  void delta_samples(unsigned char *dest, const unsigned char *a, const unsigned char *b, const TilestackInfo &info) {
+    size_t nbytes = info.bytes_per_frame();
+    switch (info.bits_per_band) {
+    case 8:  a ? subtract_samples<unsigned char>(dest, a, b, nbytes)      : add_samples<unsigned char>(dest, b, nbytes);      break;
+    case 16: a ? subtract_samples<unsigned short>(dest, a, b, nbytes)     : add_samples<unsigned short>(dest, b, nbytes);     break;
+    case 32: a ? subtract_samples<unsigned int>(dest, a, b, nbytes)       : add_samples<unsigned int>(dest, b, nbytes);       break;
+    case 64: a ? subtract_samples<unsigned long long>(dest, a, b, nbytes) : add_samples<unsigned long long>(dest, b, nbytes); break;
+    default:
+      throw_error("FrameCodec: can't delta-code %d bits per band", info.bits_per_band);
+    }
+  }
+
+  // Group byte b of every sample together, for each b;  unshuffle does the reverse
+  void shuffle_bytes(unsigned char *dest, const unsigned char *src, size_t nbytes, unsigned sample_size) {
+    size_t nsamples = nbytes / sample_size;
+    for (unsigned b = 0; b < sample_size; b++) {
+      for (size_t i = 0; i < nsamples; i++) dest[b * nsamples + i] = src[i * sample_size + b];
+    }
+  }
+
+  void unshuffle_bytes(unsigned char *dest, const unsigned char *src, size_t nbytes, unsigned sample_size) {
+    size_t nsamples = nbytes / sample_size;
+    for (unsigned b = 0; b < sample_size; b++) {
+      for (size_t i = 0; i < nsamples; i++) dest[i * sample_size + b] = src[b * nsamples + i];
+    }
+  }
+
+  void compress(std::vector<unsigned char> &dest, const unsigned char *src, size_t len,
+                const TilestackInfo &info, bool shuffle) {
+    if (shuffle && info.bits_per_band > 8) {
+      std::vector<unsigned char> shuffled(len);
+      shuffle_bytes(&shuffled[0], src, len, info.bits_per_band / 8);
+      Zlib::compress(dest, &shuffled[0], len);
+    } else {
+      Zlib::compress(dest, src, len);
+    }
+  }
+
+  void uncompress(unsigned char *dest, size_t dest_len, const unsigned char *src, size_t src_len,
+                  const TilestackInfo &info, bool shuffle) {
+    if (shuffle && info.bits_per_band > 8) {
+      std::vector<unsigned char> shuffled(dest_len);
+      check_decoded_size(Zlib::uncompress(&shuffled[0], dest_len, src, src_len), dest_len);
+      unshuffle_bytes(dest, &shuffled[0], dest_len, info.bits_per_band / 8);
+    } else {
+      check_decoded_size(Zlib::uncompress(dest, dest_len, src, src_len), dest_len);
+    }
+  }
+
+  // Split compression_format into codec and shuffle flag, checking the combination is supported
+  unsigned split_format(unsigned compression_format, bool &shuffle) {
+    shuffle = compression_format & TilestackInfo::SHUFFLE_FLAG;
+    unsigned codec = compression_format & ~TilestackInfo::SHUFFLE_FLAG;
+    if (shuffle && codec != TilestackInfo::ZLIB_COMPRESSION && codec != TilestackInfo::ZLIB_DELTA_COMPRESSION) {
+      throw_error("FrameCodec: shuffle only supported with zlib or zlib-delta compression, not format %d", codec);
+    }
+    return codec;
+  }
+
+  // libjpeg's default error handler exits the process;  jump back and throw instead
+  struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+    char message[JMSG_LENGTH_MAX];
+  };
+
+  void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorManager *err = (JpegErrorManager*) cinfo->err;
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->setjmp_buffer, 1);
+  }
+
+  void check_jpeg_format(const TilestackInfo &info) {
+    if (info.bits_per_band != 8 || info.pixel_format != PixelInfo::PIXEL_FORMAT_INTEGER ||
+        (info.bands_per_pixel != 1 && info.bands_per_pixel != 3)) {
+      throw_error("FrameCodec: JPEG compression requires 1 or 3 bands of 8-bit integer, not %d bands of %d-bit %s",
+                  info.bands_per_pixel, info.bits_per_band,
+                  info.pixel_format == PixelInfo::PIXEL_FORMAT_INTEGER ? "integer" : "float");
+    }
+  }
+
+  void jpeg_encode(std::vector<unsigned char> &dest, const unsigned char *pixels,
+                   const TilestackInfo &info, int quality) {
+    check_jpeg_format(info);
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager jerr;
+    unsigned char *outbuffer = NULL;
+    unsigned long outsize = 0;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+      jpeg_destroy_compress(&cinfo);
+      free(outbuffer);
+      throw_error("FrameCodec: JPEG compression failed: %s", jerr.message);
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &outbuffer, &outsize);
+    cinfo.image_width = info.tile_width;
+    cinfo.image_height = info.tile_height;
+    cinfo.input_components = info.bands_per_pixel;
+    cinfo.in_color_space = info.bands_per_pixel == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    size_t bytes_per_row = info.bytes_per_pixel() * info.tile_width;
+    while (cinfo.next_scanline < cinfo.image_height) {
+      JSAMPROW row = (JSAMPROW) (pixels + cinfo.next_scanline * bytes_per_row);
+      jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    dest.assign(outbuffer, outbuffer + outsize);
+    jpeg_destroy_compress(&cinfo);
+    free(outbuffer);
+  }
+
+  void jpeg_decode(unsigned char *dest, const unsigned char *src, size_t src_len, const TilestackInfo &info) {
+    check_jpeg_format(info);
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager jerr;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.setjmp_buffer)) {
+      jpeg_destroy_decompress(&cinfo);
+      throw_error("FrameCodec: JPEG decompression failed: %s", jerr.message);
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*) src, src_len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = info.bands_per_pixel == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_width != info.tile_width || cinfo.output_height != info.tile_height ||
+        cinfo.output_components != (int) info.bands_per_pixel) {
+      jpeg_destroy_decompress(&cinfo);
+      throw_error("FrameCodec: JPEG frame is %d x %d x %d, but should be %d x %d x %d",
+                  cinfo.output_width, cinfo.output_height, cinfo.output_components,
+                  info.tile_width, info.tile_height, info.bands_per_pixel);
+    }
+    size_t bytes_per_row = info.bytes_per_pixel() * info.tile_width;
+    while (cinfo.output_scanline < cinfo.output_height) {
+      JSAMPROW row = dest + cinfo.output_scanline * bytes_per_row;
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+  }
+}
+
+void FrameCodec::encode(std::vector<unsigned char> &dest, const unsigned char *pixels,
+                        const TilestackInfo &info, const TilestackWriteOptions &options,
+                        const unsigned char *previous) {
+  size_t frame_size = info.bytes_per_frame();
+  bool shuffle;
+  switch (split_format(options.compression_format, shuffle)) {
+  case TilestackInfo::NO_COMPRESSION:
+    dest.assign(pixels, pixels + frame_size);
+    break;
+  case TilestackInfo::ZLIB_COMPRESSION:
+    compress(dest, pixels, frame_size, info, shuffle);
+    break;
+  case TilestackInfo::JPEG_COMPRESSION:
+    jpeg_encode(dest, pixels, info, options.jpeg_quality);
+    break;
+  case TilestackInfo::ZLIB_FILTERED_COMPRESSION:
+    {
+      std::vector<unsigned char> filtered;
+      filter_rows(filtered, pixels, info);
+      Zlib::compress(dest, &filtered[0], filtered.size());
+    }
+    break;
+  case TilestackInfo::ZLIB_DELTA_COMPRESSION:
+    {
+      std::vector<unsigned char> compressed;
+      if (previous) {
+        std::vector<unsigned char> residual(frame_size);
+        delta_samples(&residual[0], pixels, previous, info);
+        compress(compressed, &residual[0], frame_size, info, shuffle);
+      } else {
+        compress(compressed, pixels, frame_size, info, shuffle);
+      }
+      dest.resize(delta_header_size);
+      write_u32(&dest[0], std::max(1U, options.keyframe_interval));
+      write_u32(&dest[4], previous ? 0 : 1);
+      dest.insert(dest.end(), compressed.begin(), compressed.end());
+    }
+    break;
+  case TilestackInfo::ZLIB_BANDED_COMPRESSION:
+    {
+      unsigned band_height = std::max(1U, options.band_height);
+      unsigned nbands = (info.tile_height + band_height - 1) / band_height;
+      size_t bytes_per_row = info.bytes_per_pixel() * info.tile_width;
+      dest.resize(band_header_size + 4 * nbands);
+      write_u32(&dest[0], band_height);
+      write_u32(&dest[4], nbands);
+      std::vector<unsigned char> compressed_band;
+      for (unsigned band = 0; band < nbands; band++) {
+        unsigned nrows = std::min(band_height, info.tile_height - band * band_height);
+        Zlib::compress(compressed_band, pixels + band * band_height * bytes_per_row, nrows * bytes_per_row);
+        write_u32(&dest[band_header_size + 4 * band], compressed_band.size());
+        dest.insert(dest.end(), compressed_band.begin(), compressed_band.end());
+      }
+    }
+    break;
+  default:
+    throw_error("FrameCodec: can't write compression format %d", options.compression_format);
+  }
+}
+
+void FrameCodec::decode(unsigned char *dest, const unsigned char *src, size_t src_len,
+                        const TilestackInfo &info, const unsigned char *previous) {
+  size_t frame_size = info.bytes_per_frame();
+  bool shuffle;
+  switch (split_format(info.compression_format, shuffle)) {
+  case TilestackInfo::NO_COMPRESSION:
+    check_decoded_size(src_len, frame_size);
+    memcpy(dest, src, frame_size);
+    break;
+  case TilestackInfo::ZLIB_COMPRESSION:
+    uncompress(dest, frame_size, src, src_len, info, shuffle);
+    break;
+  case TilestackInfo::JPEG_COMPRESSION:
+    jpeg_decode(dest, src, src_len, info);
+    break;
+  case TilestackInfo::ZLIB_FILTERED_COMPRESSION:
+    {
+      std::vector<unsigned char> filtered(info.tile_height * (1 + info.bytes_per_pixel() * info.tile_width));
+      filtered.resize(Zlib::uncompress(&filtered[0], filtered.size(), src, src_len));
+      unfilter_rows(dest, filtered, info);
+    }
+    break;
+  case TilestackInfo::ZLIB_DELTA_COMPRESSION:
+    {
+      keyframe_interval(src, src_len);
+      bool is_keyframe = read_u32((unsigned char*) src + 4);
+      if (!is_keyframe && !previous) throw_error("FrameCodec: delta frame decoded without previous frame");
+      uncompress(dest, frame_size, src + delta_header_size, src_len - delta_header_size, info, shuffle);
+      if (!is_keyframe) delta_samples(dest, NULL, previous, info);
+    }
+    break;
+  case TilestackInfo::ZLIB_BANDED_COMPRESSION:
+    {
+      unsigned nbands = read_nbands(src, src_len);
+      for (unsigned band = 0; band < nbands; band++) decode_band(dest, band, src, src_len, info);
+    }
+    break;
+  default:
+    throw_error("Unknown compression type in tilestack: %d", info.compression_format);
+  }
+}
+
+bool FrameCodec::decodes_bands(const TilestackInfo &info) {
+  return info.compression_format == TilestackInfo::ZLIB_BANDED_COMPRESSION;
+}
+
+bool FrameCodec::is_lossy(const TilestackInfo &info) {
+  return info.compression_format == TilestackInfo::JPEG_COMPRESSION;
+}
+
+bool FrameCodec::is_temporal(const TilestackInfo &info) {
+  return (info.compression_format & ~TilestackInfo::SHUFFLE_FLAG) == TilestackInfo::ZLIB_DELTA_COMPRESSION;
+}
+
+unsigned FrameCodec::keyframe_interval(const unsigned char *src, size_t src_len) {
+  if (src_len < delta_header_size) throw_error("FrameCodec: delta frame too short (%ld bytes)", (long) src_len);
+  unsigned interval = read_u32((unsigned char*) src);
+  if (!interval) throw_error("FrameCodec: delta frame has keyframe interval 0");
+  return interval;
+}
+
+unsigned FrameCodec::band_height(const unsigned char *src, size_t src_len) {
+  read_nbands(src, src_len);
+  unsigned band_height = read_u32((unsigned char*) src);
+  if (!band_height) throw_error("FrameCodec: banded frame has band height 0");
+  return band_height;
+}
+
+void FrameCodec::decode_band(unsigned char *dest, unsigned band, const unsigned char *src, size_t src_len,
+                             const TilestackInfo &info) {
+  assert(decodes_bands(info));
+  unsigned nbands = read_nbands(src, src_len);
+  unsigned band_height = FrameCodec::band_height(src, src_len);
+  if (band >= nbands || band * band_height >= info.tile_height) {
+    throw_error("FrameCodec: band %d out of range", band);
+  }
+  size_t offset = band_header_size + 4 * (size_t) nbands;
+  for (unsigned i = 0; i < band; i++) offset += read_u32((unsigned char*) src + band_header_size + 4 * i);
+  size_t band_len = read_u32((unsigned char*) src + band_header_size + 4 * band);
+  if (offset + band_len > src_len) throw_error("FrameCodec: band %d extends beyond end of frame", band);
+
+  size_t bytes_per_row = info.bytes_per_pixel() * info.tile_width;
+  unsigned nrows = std::min(band_height, info.tile_height - band * band_height);
+  check_decoded_size(Zlib::uncompress(dest + band * band_height * bytes_per_row, nrows * bytes_per_row,
+                                      src + offset, band_len),
+                     nrows * bytes_per_row);
+}
@@ -0,0 +1,58 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <vector>
+
+#include "Tilestack.h"
+
+// Encoding and decoding of single tilestack frames, for each TilestackInfo::CompressionFormat.
+//
+// ZLIB_BANDED_COMPRESSION frame layout (little-endian):
+//   u32 band_height             rows per band;  last band may be shorter
+//   u32 nbands
+//   u32 length[nbands]          compressed length of each band
+//   band data                   each band compressed independently with zlib, in order
+//
+// ZLIB_FILTERED_COMPRESSION frame layout:
+//   zlib stream of tile_height rows, each a filter type byte followed by the filtered row,
+//   using the PNG filter types and byte arithmetic (0=None 1=Sub 2=Up 3=Average 4=Paeth)
+//
+// ZLIB_DELTA_COMPRESSION frame layout (little-endian):
+//   u32 keyframe_interval       frame n is a keyframe iff n % keyframe_interval == 0
+//   u32 is_keyframe
+//   zlib stream                 keyframes: the pixels
+//                               others: each sample minus the previous frame's, as unsigned integers
+//                               of bits_per_band with wraparound (floating point samples are
+//                               reinterpreted as integers, so reconstruction is exact)
+//
+// With TilestackInfo::SHUFFLE_FLAG, the bytes to be deflated (pixels or residuals) are first
+// rearranged into bits_per_band/8 planes:  byte 0 of every sample, then byte 1, etc.
+
+class FrameCodec {
+ public:
+  // previous is the preceding frame's pixels, for non-keyframes of temporal formats;  NULL otherwise
+  static void encode(std::vector<unsigned char> &dest, const unsigned char *pixels,
+                     const TilestackInfo &info, const TilestackWriteOptions &options,
+                     const unsigned char *previous = NULL);
+
+  // dest must hold info.bytes_per_frame(), and must not overlap previous
+  static void decode(unsigned char *dest, const unsigned char *src, size_t src_len,
+                     const TilestackInfo &info, const unsigned char *previous = NULL);
+
+  // Do decoded frames differ from the pixels encoded?
+  static bool is_lossy(const TilestackInfo &info);
+  // Is each frame coded relative to the frame before it?
+  static bool is_temporal(const TilestackInfo &info);
+  // Keyframe interval of a stored frame, for temporal formats
+  static unsigned keyframe_interval(const unsigned char *src, size_t src_len);
+
+  // Does the format allow decoding only some rows of a frame?
+  static bool decodes_bands(const TilestackInfo &info);
+  // Number of rows per band, for formats where decodes_bands is true
+  static unsigned band_height(const unsigned char *src, size_t src_len);
+  // Decode a single band into its rows of dest, which must hold info.bytes_per_frame()
+  static void decode_band(unsigned char *dest, unsigned band, const unsigned char *src, size_t src_len,
+                          const TilestackInfo &info);
+};
+
+#endif
@@ -37,6 +37,32 @@ bool GPTileIdx::operator<(const GPTileIdx &rhs) const {
   return false;
 }
 
+GPTileIdx GPTileIdx::from_path(const std::string &filename, const std::string &extension, std::string &root) {
+  size_t slash = filename.rfind('/');
+  size_t start = slash == std::string::npos ? 0 : slash + 1;
+  if (filename.size() < start + 1 + extension.size() ||
+      filename.compare(filename.size() - extension.size(), extension.size(), extension) ||
+      filename[start] != 'r') {
+    throw_error("%s isn't a stackset tile path", filename.c_str());
+  }
+  std::string bn = filename.substr(start, filename.size() - extension.size() - start);
+  int level = bn.size() - 1, x = 0, y = 0;
+  if (level > 28) throw_error("%s isn't a stackset tile path", filename.c_str());
+  for (int i = 1; i <= level; i++) {
+    int digit = bn[i] - '0';
+    if (digit < 0 || digit > 3) throw_error("%s isn't a stackset tile path", filename.c_str());
+    x = (x << 1) | (digit & 1);
+    y = (y << 1) | (digit >> 1);
+  }
+  GPTileIdx ret(level, x, y);
+  std::string suffix = "/" + ret.path() + extension;
+  if (filename.size() < suffix.size() || filename.compare(filename.size() - suffix.size(), suffix.size(), suffix)) {
+    throw_error("%s isn't a stackset tile path", filename.c_str());
+  }
+  root = filename.substr(0, filename.size() - suffix.size());
+  return ret;
+}
+
 std::string GPTileIdx::to_string() const {
   return string_printf("[GPTileIdx l=%d x=%d y=%d %s]",
 		       level, x, y, path().c_str());
@@ -11,6 +11,8 @@ public:
   std::string path() const;
   bool operator<(const GPTileIdx &rhs) const;
   std::string to_string() const;
+  // Tile of filename root + "/" + path() + extension, setting root;  throws if filename isn't one
+  static GPTileIdx from_path(const std::string &filename, const std::string &extension, std::string &root);
   static unsigned long long idx(int level, int x, int y) {
     return 
       (((unsigned long long) level)            << 56) |
@@ -1,33 +1,60 @@
 #include <assert.h>
 
+#include <algorithm>
 #include <stdexcept>
 #include <vector>
 
 #include "cpp_utils.h"
+#include "io.h"
 #include "marshal.h"
 
 #include "ImageReader.h"
 
+#ifdef __MINGW32__
+  #define fseeko fseeko64
+#elif _WIN32
+  #define fseeko _fseeki64
+#endif
+
 ////// ImageReader
 
-ImageReader *ImageReader::open(const std::string &filename) {
+ImageReader *ImageReader::open(const std::string &filename, unsigned int scale_denom) {
+  if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8) {
+    throw_error("Can't decode %s at 1/%u scale;  scale must be 1, 2, 4, or 8", filename.c_str(), scale_denom);
+  }
   std::string format = filename_suffix(filename);
-  if (iequals(format, "jpg")) return new JpegReader(filename);
+  if (iequals(format, "jpg")) return new JpegReader(filename, scale_denom);
+  if (scale_denom != 1) throw_error("Can't decode %s at reduced scale;  only JPEG supports it", filename.c_str());
   if (iequals(format, "kro")) return new KroReader(filename);
   if (iequals(format, "png")) return new PngReader(filename);
   throw_error("Unrecognized image format from filename %s", filename.c_str());
 }
 
+void ImageReader::skip_rows(unsigned int nrows) const {
+  unsigned chunk = std::max(1U, std::min(nrows, (4U << 20) / std::max(1U, bytes_per_row())));
+  std::vector<unsigned char> discard(chunk * bytes_per_row());
+  for (unsigned skipped = 0; skipped < nrows; skipped += chunk) {
+    read_rows(&discard[0], std::min(chunk, nrows - skipped));
+  }
+}
+
+void ImageReader::advise_closing(FILE *in) const {
+  if (drop_on_close) FileAdvice::advise(in, 0, 0, FileAdvice::DONTNEED);
+}
+
 ////// JpegReader
 
-JpegReader::JpegReader(const std::string &filename) : filename(filename) {
+JpegReader::JpegReader(const std::string &filename, unsigned int scale_denom) : filename(filename) {
   in = fopen(filename.c_str(), "rb");
   if (!in) throw_error("Can't open %s for reading", filename.c_str());
+  FileAdvice::advise(in, 0, 0, FileAdvice::SEQUENTIAL);
 
   cinfo.err = jpeg_std_error(&jerr);
   jpeg_create_decompress(&cinfo);
   jpeg_stdio_src(&cinfo, in);
   jpeg_read_header(&cinfo, TRUE);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale_denom;
   jpeg_start_decompress(&cinfo);
   m_bands_per_pixel = cinfo.output_components;
   m_bits_per_band = 8;
@@ -46,10 +73,22 @@ void JpegReader::read_rows(unsigned char *pixels, unsigned int nrows) const {
   }
 }
 
+// Skips without the inverse DCT or color conversion of the skipped rows;  libjpeg still has to
+// entropy-decode them
+void JpegReader::skip_rows(unsigned int nrows) const {
+  unsigned nskipped = 0;
+  while (nskipped < nrows) {
+    JDIMENSION n = jpeg_skip_scanlines(&cinfo, nrows - nskipped);
+    if (!n) throw_error("Can't skip rows of %s", filename.c_str());
+    nskipped += n;
+  }
+}
+
 void JpegReader::close() {
   if (in) {
     jpeg_abort_decompress(&cinfo); // abort rather than finish because we might not have read all lines
     jpeg_destroy_decompress(&cinfo);
+    advise_closing(in);
     fclose(in);
     in = NULL;
   }
@@ -64,6 +103,7 @@ JpegReader::~JpegReader() {
 KroReader::KroReader(const std::string &filename) : filename(filename) {
   in = fopen(filename.c_str(), "rb");
   if (!in) throw_error("Can't open %s for reading", filename.c_str());
+  FileAdvice::advise(in, 0, 0, FileAdvice::SEQUENTIAL);
 
   unsigned char header[20];
   if (1 != fread(header, sizeof(header), 1, in)) {
@@ -85,8 +125,15 @@ void KroReader::read_rows(unsigned char *pixels, unsigned int nrows) const {
   }
 }
 
+void KroReader::skip_rows(unsigned int nrows) const {
+  if (fseeko(in, (long long) bytes_per_row() * nrows, SEEK_CUR)) {
+    throw_error("Can't skip rows of %s", filename.c_str());
+  }
+}
+
 void KroReader::close() {
   if (in) {
+    advise_closing(in);
     fclose(in);
     in = NULL;
   }
@@ -105,6 +152,7 @@ PngReader::PngReader(const std::string &filename) : filename(filename) {
   
   in = fopen(filename.c_str(), "rb");
   if (!in) throw_error("Can't open %s for reading", filename.c_str());
+  FileAdvice::advise(in, 0, 0, FileAdvice::SEQUENTIAL);
 
   unsigned char header[8];
   if (1 != fread(header, sizeof(header), 1, in)) {
@@ -169,6 +217,7 @@ void PngReader::close() {
   }
 
   if (in) { 
+    advise_closing(in);
     fclose(in); 
     in = NULL;
   }
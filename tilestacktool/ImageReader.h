@@ -14,7 +14,12 @@ class ImageReader {
   int m_height;
   int m_bands_per_pixel;
   int m_bits_per_band;
+  void advise_closing(FILE *in) const;
  public:
+  // Drop the file from the page cache on close, e.g. for source tiles read once and then deleted
+  bool drop_on_close;
+
+  ImageReader() : drop_on_close(false) {}
   unsigned int width() const { return m_width; }
   unsigned int height() const { return m_height; }
   unsigned int bands_per_pixel() const { return m_bands_per_pixel; }
@@ -23,9 +28,13 @@ class ImageReader {
   unsigned int bytes_per_row() const { return bytes_per_pixel() * m_width; }
 
   virtual void read_rows(unsigned char *pixels, unsigned int nrows) const = 0;
+  // Skip the next nrows rows.  By default they're read and discarded
+  virtual void skip_rows(unsigned int nrows) const;
   virtual void close() = 0;
   virtual ~ImageReader() {}
-  static ImageReader *open(const std::string &filename);
+  // With scale_denom 2, 4 or 8, the image is decoded at 1/scale_denom of its size in each dimension
+  // (rounding up).  JPEG only, where it's done by libjpeg while decoding, for a fraction of the cost
+  static ImageReader *open(const std::string &filename, unsigned int scale_denom = 1);
 };
 
 class JpegReader : public ImageReader {
@@ -35,8 +44,9 @@ class JpegReader : public ImageReader {
   struct jpeg_error_mgr jerr;
   
  public:
-  JpegReader(const std::string &filename);
+  JpegReader(const std::string &filename, unsigned int scale_denom = 1);
   virtual void read_rows(unsigned char *pixels, unsigned int nrows) const;
+  virtual void skip_rows(unsigned int nrows) const;
   virtual void close();
   virtual ~JpegReader();
 };
@@ -48,6 +58,7 @@ class KroReader : public ImageReader {
  public:
   KroReader(const std::string &filename);
   virtual void read_rows(unsigned char *pixels, unsigned int nrows) const;
+  virtual void skip_rows(unsigned int nrows) const;
   virtual void close();
   virtual ~KroReader();
 };
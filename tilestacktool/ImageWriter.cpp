@@ -27,35 +27,29 @@ void ImageWriter::write(const std::string &filename, int width, int height, int
 
 KroWriter::KroWriter(const std::string &filename, int width, int height, int bands_per_pixel, int bits_per_band) :
   ImageWriter(width, height, bands_per_pixel, bits_per_band), filename(filename) {
-  out = fopen(filename.c_str(), "wb");
-  if (!out) throw_error("Can't open %s for writing", filename.c_str());
-  setvbuf(out, NULL, _IOFBF, 1024*1024); // increase buffering to 1MB
+  out.reset(FileWriter::open(filename));
   unsigned char header[20];
   write_u32_be(&header[0], 0x4b52f401); // KRO\001
   write_u32_be(&header[4], width);
   write_u32_be(&header[8], height);
   write_u32_be(&header[12], bits_per_band);
   write_u32_be(&header[16], bands_per_pixel);
-  if (1 != fwrite(header, sizeof(header), 1, out)) {
-    throw_error("Can't write header to %s", filename.c_str());
-  }
+  out->write(header, sizeof(header));
 }
 
 void KroWriter::write_rows(const unsigned char *pixels, unsigned int nrows) const {
-  if (1 != fwrite(pixels, nrows * bytes_per_row(), 1, out)) {
-    throw_error("Error writing pixels to %s", filename.c_str());
-  }
+  out->write(pixels, nrows * bytes_per_row());
 }
 
 void KroWriter::close() {
-  if (out) {
-    fclose(out);
-    out = NULL;
+  if (out.get()) {
+    out->close();
+    out.reset(NULL);
   }
 }
 
 KroWriter::~KroWriter() {
-  close();
+  // out closes itself if close wasn't called
 }
 
 
@@ -7,6 +7,9 @@
 
 #include <jpeglib.h>
 
+#include "io.h"
+#include "simple_shared_ptr.h"
+
 class ImageWriter {
  protected:
   int m_width;
@@ -30,7 +33,7 @@ class ImageWriter {
 };
 
 class KroWriter : public ImageWriter {
-  FILE *out;
+  simple_shared_ptr<FileWriter> out;
   std::string filename;
   
  public:
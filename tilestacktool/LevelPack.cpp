@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "cpp_utils.h"
+#include "marshal.h"
+#include "LevelPack.h"
+
+namespace {
+  const unsigned long long pack_magic = 0x31306b6361707374ULL;  // ASCII 'tspack01'
+  const unsigned long long entry_magic = 0x7972746e6b707374ULL; // ASCII 'tspkntry'
+  const unsigned long long index_magic = 0x317864696b707374ULL; // ASCII 'tspkidx1'
+  const size_t header_size = 8;
+  const size_t entry_header_size = 24;
+  const size_t index_entry_size = 24;
+  const size_t footer_size = 24;
+
+  bool by_idx(const LevelPack::Entry &a, const LevelPack::Entry &b) { return a.idx < b.idx; }
+}
+
+// LevelPack
+
+int LevelPack::packs_opened;
+int LevelPack::tilestacks_opened;
+int LevelPack::tilestacks_appended;
+
+std::string LevelPack::path(const std::string &stackset, int level) {
+  return string_printf("%s/level-%d.tspack", stackset.c_str(), level);
+}
+
+LevelPack::LevelPack(simple_shared_ptr<Reader> reader, const std::string &name) :
+  // The tilestacks of a pack may be read from several threads at once
+  reader(reader->thread_safe() ? reader : simple_shared_ptr<Reader>(new LockedReader(reader))), name(name) {
+  size_t len = reader->length();
+  if (len < header_size + footer_size) throw_error("LevelPack: %s is too short", name.c_str());
+  std::vector<unsigned char> header = reader->read(0, header_size);
+  std::vector<unsigned char> footer = reader->read(len - footer_size, footer_size);
+  if (read_u64(&header[0]) != pack_magic) throw_error("LevelPack: %s isn't a level pack", name.c_str());
+  unsigned long long index_offset = read_u64(&footer[0]), count = read_u64(&footer[8]);
+  if (read_u64(&footer[16]) != index_magic || index_offset < header_size ||
+      index_offset > len - footer_size || count != (len - footer_size - index_offset) / index_entry_size ||
+      (len - footer_size - index_offset) % index_entry_size) {
+    throw_error("LevelPack: %s has no valid index (interrupted while appending?)", name.c_str());
+  }
+  std::vector<unsigned char> raw = reader->read(index_offset, count * index_entry_size);
+  index.resize(count);
+  for (unsigned i = 0; i < count; i++) {
+    Entry &e = index[i];
+    e.idx = read_u64(&raw[i * index_entry_size]);
+    e.offset = read_u64(&raw[i * index_entry_size + 8]);
+    e.length = read_u64(&raw[i * index_entry_size + 16]);
+    if (e.offset > index_offset || e.length > index_offset - e.offset || (i && e.idx <= index[i-1].idx)) {
+      throw_error("LevelPack: %s has a corrupt index", name.c_str());
+    }
+  }
+  packs_opened++;
+}
+
+bool LevelPack::find(unsigned long long idx, Entry &entry) const {
+  Entry key;
+  key.idx = idx;
+  std::vector<Entry>::const_iterator i = std::lower_bound(index.begin(), index.end(), key, by_idx);
+  if (i == index.end() || i->idx != idx) return false;
+  entry = *i;
+  return true;
+}
+
+Reader *LevelPack::open(unsigned long long idx) const {
+  Entry entry;
+  if (!find(idx, entry)) return NULL;
+  tilestacks_opened++;
+  return new SubrangeReader(reader, entry.offset, entry.length);
+}
+
+std::string LevelPack::stats() {
+  if (!packs_opened && !tilestacks_appended) return "";
+  return string_printf("Level packs: %d tilestacks appended;  %d tilestacks read from %d packs.",
+                       tilestacks_appended, tilestacks_opened, packs_opened);
+}
+
+// LevelPackWriter
+
+LevelPackWriter::LevelPackWriter(const std::string &filename, unsigned long long idx) :
+  filename(filename), fd(-1), idx(idx), entry_start(header_size), pos(0) {
+#ifdef _WIN32
+  throw_error("LevelPackWriter: appending to %s:  level packs can't be written on Windows", filename.c_str());
+#else
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) throw_error("LevelPackWriter: can't open %s (%s)", filename.c_str(), strerror(errno));
+  int ret;
+  while ((ret = flock(fd, LOCK_EX)) < 0 && errno == EINTR) {}
+  struct stat st;
+  if (ret < 0 || fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    fd = -1;
+    throw_error("LevelPackWriter: can't lock %s (%s)", filename.c_str(), strerror(err));
+  }
+
+  try {
+    unsigned long long len = st.st_size;
+    if (!len) {
+      unsigned char header[header_size];
+      write_u64(header, pack_magic);
+      write_at(header, header_size, 0);
+    } else {
+      try {
+        LevelPack pack(simple_shared_ptr<Reader>(FileReader::open(filename)), filename);
+        for (unsigned i = 0; i < pack.index.size(); i++) index[pack.index[i].idx] = pack.index[i];
+        entry_start = len - footer_size - pack.index.size() * index_entry_size;
+        LevelPack::packs_opened--; // opened only to append
+      } catch (std::runtime_error &e) {
+        recover(len);
+      }
+    }
+    // Drop the old index and footer, so that if interrupted the pack can't appear valid with
+    // this tilestack written over its index
+    if (ftruncate(fd, entry_start) < 0) {
+      throw_error("LevelPackWriter: error truncating %s (%s)", filename.c_str(), strerror(errno));
+    }
+  } catch (std::runtime_error &e) {
+    ::close(fd);
+    fd = -1;
+    throw;
+  }
+#endif
+}
+
+void LevelPackWriter::write_at(const unsigned char *src, size_t length, unsigned long long offset) {
+#ifndef _WIN32
+  while (length) {
+    ssize_t n = pwrite(fd, src, length, offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) throw_error("LevelPackWriter: error writing %s (%s)", filename.c_str(), strerror(errno));
+    src += n;
+    offset += n;
+    length -= n;
+  }
+#endif
+}
+
+// Write the index and footer at start, and truncate after them
+void LevelPackWriter::write_index(const std::map<unsigned long long, LevelPack::Entry> &index,
+                                  unsigned long long start) {
+#ifndef _WIN32
+  std::vector<unsigned char> buf(index.size() * index_entry_size + footer_size);
+  unsigned char *p = &buf[0];
+  for (std::map<unsigned long long, LevelPack::Entry>::const_iterator i = index.begin(); i != index.end(); ++i) {
+    write_u64(p, i->second.idx);
+    write_u64(p + 8, i->second.offset);
+    write_u64(p + 16, i->second.length);
+    p += index_entry_size;
+  }
+  write_u64(p, start);
+  write_u64(p + 8, index.size());
+  write_u64(p + 16, index_magic);
+  write_at(&buf[0], buf.size(), start);
+  if (ftruncate(fd, start + buf.size()) < 0) {
+    throw_error("LevelPackWriter: error truncating %s (%s)", filename.c_str(), strerror(errno));
+  }
+#endif
+}
+
+// Rebuild the index of a pack without a valid footer from its entry headers, keeping the complete
+// entries and dropping anything after them
+void LevelPackWriter::recover(unsigned long long file_length) {
+#ifndef _WIN32
+  simple_shared_ptr<Reader> reader(FileReader::open(filename));
+  if (file_length < header_size || read_u64(&reader->read(0, header_size)[0]) != pack_magic) {
+    throw_error("LevelPackWriter: %s exists but isn't a level pack", filename.c_str());
+  }
+  unsigned long long start = header_size;
+  while (start + entry_header_size <= file_length) {
+    std::vector<unsigned char> header = reader->read(start, entry_header_size);
+    unsigned long long length = read_u64(&header[16]);
+    if (read_u64(&header[0]) != entry_magic || length > file_length - start - entry_header_size) break;
+    LevelPack::Entry &e = index[read_u64(&header[8])];
+    e.idx = read_u64(&header[8]);
+    e.offset = start + entry_header_size;
+    e.length = length;
+    start += entry_header_size + length;
+  }
+  entry_start = start;
+  fprintf(stderr, "LevelPackWriter: %s had no valid index;  recovered %d tilestacks from entry headers\n",
+          filename.c_str(), (int) index.size());
+#endif
+}
+
+void LevelPackWriter::write(const unsigned char *src, size_t length) {
+  if (fd < 0) throw_error("LevelPackWriter: write to %s after close", filename.c_str());
+  write_at(src, length, entry_start + entry_header_size + pos);
+  pos += length;
+}
+
+void LevelPackWriter::close() {
+  if (fd < 0) return;
+#ifndef _WIN32
+  unsigned char header[entry_header_size];
+  write_u64(header, entry_magic);
+  write_u64(header + 8, idx);
+  write_u64(header + 16, pos);
+  write_at(header, entry_header_size, entry_start);
+  std::map<unsigned long long, LevelPack::Entry> updated(index);
+  LevelPack::Entry &e = updated[idx];
+  e.idx = idx;
+  e.offset = entry_start + entry_header_size;
+  e.length = pos;
+  write_index(updated, entry_start + entry_header_size + pos);
+  ::close(fd); // releases the lock
+  fd = -1;
+  LevelPack::tilestacks_appended++;
+#endif
+}
+
+LevelPackWriter::~LevelPackWriter() {
+#ifndef _WIN32
+  if (fd < 0) return;
+  // Abandoned:  put back the index this tilestack was being written over
+  try {
+    write_index(index, entry_start);
+  } catch (std::runtime_error &e) {
+    fprintf(stderr, "%s\n", e.what());
+  }
+  ::close(fd);
+#endif
+}
@@ -0,0 +1,72 @@
+#ifndef LEVEL_PACK_H
+#define LEVEL_PACK_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "io.h"
+#include "simple_shared_ptr.h"
+
+// All the tilestacks of one pyramid level of a stackset in a single file, <stackset>/level-N.tspack,
+// so that rendering opens one file per level instead of one per tile.
+//
+// Layout, integers u64 little-endian:
+//   'tspack01'
+//   entries:  'tspkntry', GPTileIdx::idx, length, then the .ts2 file itself
+//   index:    (GPTileIdx::idx, offset of the .ts2, length) per tilestack, sorted by idx
+//   footer:   index offset, index entries, 'tspkidx1'
+//
+// Appending a tilestack writes it over the old index, then writes a new index and footer, holding
+// an exclusive flock throughout so that parallel jobs may append to the same pack.  Replacing a
+// tilestack leaves its old copy as dead space.  An append interrupted by a crash leaves the pack
+// without a footer;  readers then fail, and the next append rebuilds the index from the entry
+// headers.  Packs shouldn't be read while being appended to.  Appending isn't available on Windows.
+
+class LevelPack {
+public:
+  struct Entry {
+    unsigned long long idx, offset, length;
+  };
+
+  static std::string path(const std::string &stackset, int level);
+
+  // Reads the index;  throws if reader doesn't hold a complete pack
+  LevelPack(simple_shared_ptr<Reader> reader, const std::string &name);
+  // Sets entry and returns true if the pack holds tilestack idx
+  bool find(unsigned long long idx, Entry &entry) const;
+  // The tilestack idx as a file of its own, or NULL if not in the pack
+  Reader *open(unsigned long long idx) const;
+  size_t size() const { return index.size(); }
+
+  static std::string stats();
+
+private:
+  simple_shared_ptr<Reader> reader;
+  std::string name;
+  std::vector<Entry> index;
+  static int packs_opened, tilestacks_opened, tilestacks_appended;
+  friend class LevelPackWriter;
+};
+
+// Appends one tilestack to a LevelPack, creating the pack if needed.  Write the .ts2 through this,
+// then close() to make it part of the pack.  Destroying the writer without closing abandons the
+// tilestack and restores the pack as it was.
+class LevelPackWriter : public Writer {
+  std::string filename;
+  int fd;
+  unsigned long long idx;
+  std::map<unsigned long long, LevelPack::Entry> index;
+  unsigned long long entry_start, pos;
+
+  void write_at(const unsigned char *src, size_t length, unsigned long long offset);
+  void write_index(const std::map<unsigned long long, LevelPack::Entry> &index, unsigned long long start);
+  void recover(unsigned long long file_length);
+public:
+  LevelPackWriter(const std::string &filename, unsigned long long idx);
+  virtual void write(const unsigned char *src, size_t length);
+  virtual void close();
+  virtual ~LevelPackWriter();
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "cpp_utils.h"
+#include "SharedFrameCache.h"
+
+namespace {
+  const size_t segment_header_size = 64;  // u64 use clock, then padding
+  const size_t slot_header_size = 64;     // u64 sequence, u64 last use, u64 key hash[2], then padding
+  const unsigned ways = 8;                // slots a frame may occupy
+
+  std::atomic<unsigned long long> hits, misses, inserts, lost_races;
+
+  unsigned long long hash64(const std::string &key, unsigned frame, unsigned long long basis,
+                            unsigned long long prime) {
+    unsigned long long h = basis;
+    for (unsigned i = 0; i < key.size(); i++) h = (h ^ (unsigned char) key[i]) * prime;
+    for (unsigned i = 0; i < 4; i++) h = (h ^ ((frame >> (8 * i)) & 0xff)) * prime;
+    return h;
+  }
+
+  unsigned long long load(const unsigned long long *p, int order) { return __atomic_load_n(p, order); }
+  void store(unsigned long long *p, unsigned long long val, int order) { __atomic_store_n(p, val, order); }
+}
+
+struct SharedFrameCache::Segment {
+  std::string name;
+  unsigned char *base;
+  size_t size, slot_size;
+  unsigned nsets;
+
+  unsigned long long *clock() { return (unsigned long long*) base; }
+  unsigned long long *slot(unsigned set, unsigned way) {
+    return (unsigned long long*) (base + segment_header_size + (set * ways + way) * slot_size);
+  }
+  unsigned char *slot_data(unsigned long long *slot) { return (unsigned char*) slot + slot_header_size; }
+};
+
+std::map<size_t, SharedFrameCache::Segment*> SharedFrameCache::segments;
+std::mutex SharedFrameCache::segments_mutex;
+size_t SharedFrameCache::budget;
+
+// Returns NULL if the segment can't be opened
+SharedFrameCache::Segment *SharedFrameCache::segment(size_t length) {
+#ifdef _WIN32
+  return NULL;
+#else
+  std::lock_guard<std::mutex> lock(segments_mutex);
+  std::map<size_t, Segment*>::iterator i = segments.find(length);
+  if (i != segments.end()) return i->second;
+
+  Segment *seg = NULL;
+  size_t slot_size = slot_header_size + (length + 63) / 64 * 64;
+  unsigned nsets = budget / (slot_size * ways);
+  if (nsets) {
+    std::string name = string_printf("/tilestacktool-%u-%zu-%zu", (unsigned) getuid(), budget >> 20, length);
+    size_t size = segment_header_size + nsets * ways * slot_size;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    // The segment name fixes its size, so concurrent creators all truncate to the same size
+    if (fd >= 0 && fstat(fd, &st) == 0 && ((size_t) st.st_size == size || ftruncate(fd, size) == 0)) {
+      void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base != MAP_FAILED) {
+        seg = new Segment();
+        seg->name = name;
+        seg->base = (unsigned char*) base;
+        seg->size = size;
+        seg->slot_size = slot_size;
+        seg->nsets = nsets;
+      }
+    }
+    if (fd >= 0) close(fd);
+    if (!seg) fprintf(stderr, "SharedFrameCache: can't open shared memory %s;  not caching\n", name.c_str());
+  }
+  segments[length] = seg;
+  return seg;
+#endif
+}
+
+std::string SharedFrameCache::file_key(const std::string &filename) {
+#ifdef _WIN32
+  return "";
+#else
+  struct stat st;
+  char *path = realpath(filename.c_str(), NULL);
+  if (!path) return "";
+  std::string key = path;
+  free(path);
+  if (stat(key.c_str(), &st)) return "";
+  return key + string_printf(":%lld:%lld:%lld", (long long) st.st_mtime, (long long) st.st_size,
+                             (long long) st.st_ino);
+#endif
+}
+
+bool SharedFrameCache::lookup(const std::string &key, unsigned frame, unsigned char *dest, size_t length) {
+  Segment *seg = budget ? segment(length) : NULL;
+  if (!seg) return false;
+  unsigned long long h1 = hash64(key, frame, 0xcbf29ce484222325ULL, 0x100000001b3ULL);
+  unsigned long long h2 = hash64(key, frame, 0x84222325cbf29ce4ULL, 0xc6a4a7935bd1e995ULL) | 1;
+  unsigned set = h1 % seg->nsets;
+  for (unsigned way = 0; way < ways; way++) {
+    unsigned long long *slot = seg->slot(set, way);
+    unsigned long long seq = load(&slot[0], __ATOMIC_ACQUIRE);
+    if (!seq || (seq & 1)) continue;
+    if (load(&slot[2], __ATOMIC_RELAXED) != h1 || load(&slot[3], __ATOMIC_RELAXED) != h2) continue;
+    memcpy(dest, seg->slot_data(slot), length);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (load(&slot[0], __ATOMIC_RELAXED) != seq) continue; // overwritten while copying
+    store(&slot[1], __atomic_add_fetch(seg->clock(), 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    hits++;
+    return true;
+  }
+  misses++;
+  return false;
+}
+
+void SharedFrameCache::insert(const std::string &key, unsigned frame, const unsigned char *data, size_t length) {
+  Segment *seg = budget ? segment(length) : NULL;
+  if (!seg) return;
+  unsigned long long h1 = hash64(key, frame, 0xcbf29ce484222325ULL, 0x100000001b3ULL);
+  unsigned long long h2 = hash64(key, frame, 0x84222325cbf29ce4ULL, 0xc6a4a7935bd1e995ULL) | 1;
+  unsigned set = h1 % seg->nsets;
+
+  // Replace an empty slot if any, else the least recently used;  skip slots being written
+  unsigned long long *victim = NULL, victim_seq = 0, victim_use = 0;
+  for (unsigned way = 0; way < ways; way++) {
+    unsigned long long *slot = seg->slot(set, way);
+    unsigned long long seq = load(&slot[0], __ATOMIC_ACQUIRE);
+    if (seq & 1) continue;
+    if (seq && load(&slot[2], __ATOMIC_RELAXED) == h1 && load(&slot[3], __ATOMIC_RELAXED) == h2) return;
+    unsigned long long use = seq ? load(&slot[1], __ATOMIC_RELAXED) : 0;
+    if (!victim || use < victim_use) {
+      victim = slot;
+      victim_seq = seq;
+      victim_use = use;
+    }
+  }
+  if (!victim || !__atomic_compare_exchange_n(&victim[0], &victim_seq, victim_seq + 1, false,
+                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    lost_races++;
+    return;
+  }
+  store(&victim[2], h1, __ATOMIC_RELAXED);
+  store(&victim[3], h2, __ATOMIC_RELAXED);
+  memcpy(seg->slot_data(victim), data, length);
+  store(&victim[1], __atomic_add_fetch(seg->clock(), 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  store(&victim[0], victim_seq + 2, __ATOMIC_RELEASE);
+  inserts++;
+}
+
+void SharedFrameCache::remove() {
+#ifndef _WIN32
+  std::lock_guard<std::mutex> lock(segments_mutex);
+  for (std::map<size_t, Segment*>::iterator i = segments.begin(); i != segments.end(); ++i) {
+    if (!i->second) continue;
+    shm_unlink(i->second->name.c_str());
+    munmap(i->second->base, i->second->size);
+    delete i->second;
+  }
+  segments.clear();
+#endif
+}
+
+std::string SharedFrameCache::stats() {
+  if (!budget) return "";
+  unsigned long long lookups = hits + misses;
+  return string_printf("Shared frame cache: %llu hits, %llu misses (%.0f%% hit rate), %llu frames inserted, "
+                       "%llu inserts lost to other writers",
+                       (unsigned long long) hits, (unsigned long long) misses,
+                       lookups ? 100.0 * hits / lookups : 0.0, (unsigned long long) inserts,
+                       (unsigned long long) lost_races);
+}
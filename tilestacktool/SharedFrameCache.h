@@ -0,0 +1,41 @@
+#ifndef SHARED_FRAME_CACHE_H
+#define SHARED_FRAME_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// Decoded frames shared by all tilestacktool processes of a user on a host, e.g. the parallel jobs
+// of ct.rb -j N, through POSIX shared memory.  Frames are keyed by (tilestack path, mtime, size,
+// frame), so a rewritten tilestack never matches stale entries.
+//
+// There is one segment per frame size, named /tilestacktool-<uid>-<budget MB>-<frame bytes>,
+// divided into fixed-size slots and zero-filled (all slots empty) on creation.  Each slot is
+// guarded by a sequence number:  even when stable (0 = empty), odd while being written.  Writers
+// claim a slot by compare-and-swap to odd, write it, and bump it to even again;  readers copy the
+// frame out and discard the copy if the sequence number changed meanwhile.  No process ever waits
+// on another;  a lost race is a miss.  A process killed mid-write leaves its slot unusable until
+// the segment is removed (rm /dev/shm/tilestacktool-* on Linux).  Not available on Windows.
+
+class SharedFrameCache {
+  struct Segment;
+  static std::map<size_t, Segment*> segments; // by frame size
+  static std::mutex segments_mutex;
+  static Segment *segment(size_t length);
+
+public:
+  static size_t budget; // bytes per segment;  0 disables
+
+  // Returns the key identifying the current contents of filename, or "" if it can't be accessed
+  static std::string file_key(const std::string &filename);
+
+  // If frame of the file with key is cached, copy its length bytes to dest and return true
+  static bool lookup(const std::string &key, unsigned frame, unsigned char *dest, size_t length);
+  static void insert(const std::string &key, unsigned frame, const unsigned char *data, size_t length);
+
+  // Unlink the segments this process has opened;  other processes keep any they have mapped
+  static void remove();
+  static std::string stats();
+};
+
+#endif
@@ -60,3 +60,30 @@ bool Zlib::uncompress(std::vector<unsigned char> &dest, const unsigned char *src
   (void)inflateEnd(&strm);
   return true;
 }
+
+size_t Zlib::uncompress(unsigned char *dest, size_t dest_len, const unsigned char *src, size_t src_len) {
+  z_stream strm;
+
+  /* allocate inflate state */
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = src_len;
+  strm.next_in = (unsigned char*) src;
+  int ret = inflateInit(&strm);
+  if (ret != Z_OK) throw_error("Error %d in zlib inflateInit", ret);
+
+  unsigned char empty; // zlib rejects a NULL next_out even when avail_out is 0
+  strm.avail_out = dest_len;
+  strm.next_out = dest ? dest : &empty;
+
+  ret = inflate(&strm, Z_FINISH);
+  (void)inflateEnd(&strm);
+  if (ret == Z_BUF_ERROR && strm.avail_out == 0) {
+    throw_error("zlib uncompress: output larger than %ld bytes", (long) dest_len);
+  }
+  if (ret != Z_STREAM_END) {
+    throw_error("Error %d in zlib uncompress", ret);
+  }
+  return dest_len - strm.avail_out;
+}
@@ -1,12 +1,16 @@
 #ifndef SIMPLE_ZLIB_H
 #define SIMPLE_ZLIB_H
 
+#include <stddef.h>
 #include <vector>
 
 class Zlib {
  public:
   static bool compress(std::vector<unsigned char> &dest, const unsigned char *src, size_t src_len);
   static bool uncompress(std::vector<unsigned char> &dest, const unsigned char *src, size_t src_len);
+  // Uncompress directly into dest, which must be large enough to hold the entire output.
+  // Returns number of bytes written
+  static size_t uncompress(unsigned char *dest, size_t dest_len, const unsigned char *src, size_t src_len);
 };
 
 #endif
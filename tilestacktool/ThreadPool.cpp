@@ -0,0 +1,55 @@
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+unsigned int ThreadPool::default_nthreads = 0;
+
+ThreadPool::ThreadPool(unsigned int nthreads) : stopping(false) {
+  for (unsigned i = 0; i < nthreads; i++) {
+    workers.push_back(std::thread(&ThreadPool::work, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  task_available.notify_all();
+  for (unsigned i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task) {
+  std::packaged_task<void()> packaged(task);
+  std::future<void> ret = packaged.get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks.push_back(std::move(packaged));
+  }
+  task_available.notify_one();
+  return ret;
+}
+
+void ThreadPool::work() {
+  while (true) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping && tasks.empty()) task_available.wait(lock);
+      // Finish queued tasks before stopping, so that no future is left without a result
+      if (tasks.empty()) return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+unsigned int ThreadPool::default_size() {
+  if (!default_nthreads) default_nthreads = std::max(1U, std::thread::hardware_concurrency());
+  return default_nthreads;
+}
+
+void ThreadPool::set_default_size(unsigned int nthreads) {
+  default_nthreads = std::max(1U, nthreads);
+}
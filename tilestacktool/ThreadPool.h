@@ -0,0 +1,38 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads running tasks in submission order.
+// Exceptions thrown by a task are rethrown from the future's get()
+
+class ThreadPool {
+  std::vector<std::thread> workers;
+  std::deque<std::packaged_task<void()> > tasks;
+  std::mutex mutex;
+  std::condition_variable task_available;
+  bool stopping;
+
+  static unsigned int default_nthreads;
+
+  void work();
+
+public:
+  ThreadPool(unsigned int nthreads);
+  ~ThreadPool();
+
+  std::future<void> submit(std::function<void()> task);
+  unsigned int size() const { return workers.size(); }
+
+  // Number of threads to use for parallel work;  defaults to the number of hardware threads
+  static unsigned int default_size();
+  static void set_default_size(unsigned int nthreads);
+};
+
+#endif
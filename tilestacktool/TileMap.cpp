@@ -0,0 +1,89 @@
+#include <assert.h>
+
+#include <algorithm>
+
+#include "cpp_utils.h"
+#include "marshal.h"
+#include "TileMap.h"
+
+namespace {
+  const unsigned long long tile_map_magic = 0x31706d6c69747374ULL; // ASCII 'tstilmp1'
+}
+
+TileMap::TileMap(int nlevels, int width, int height, int tile_width, int tile_height) : levels(nlevels) {
+  for (int level = 0; level < nlevels; level++) {
+    // Each level up halves the resolution
+    long long level_tile_width = (long long) tile_width << (nlevels - 1 - level);
+    long long level_tile_height = (long long) tile_height << (nlevels - 1 - level);
+    levels[level].cols = std::max(1LL, (width + level_tile_width - 1) / level_tile_width);
+    levels[level].rows = std::max(1LL, (height + level_tile_height - 1) / level_tile_height);
+    levels[level].bits.resize((levels[level].cols * levels[level].rows + 7) / 8);
+  }
+}
+
+TileMap::TileMap(const std::vector<unsigned char> &serialized) {
+  if (serialized.size() < 12) throw_error("TileMap: not a tile map");
+  unsigned char *s = const_cast<unsigned char*>(&serialized[0]);
+  if (read_u64(s) != tile_map_magic) throw_error("TileMap: not a tile map");
+  size_t pos = 12;
+  if (read_u32(s + 8) > 32) throw_error("TileMap: invalid number of levels");
+  levels.resize(read_u32(s + 8));
+  for (unsigned level = 0; level < levels.size(); level++) {
+    if (serialized.size() - pos < 8) throw_error("TileMap: truncated");
+    levels[level].cols = read_u32(s + pos);
+    levels[level].rows = read_u32(s + pos + 4);
+    pos += 8;
+    size_t nbytes = ((unsigned long long) levels[level].cols * levels[level].rows + 7) / 8;
+    if (serialized.size() - pos < nbytes) throw_error("TileMap: truncated");
+    levels[level].bits.assign(s + pos, s + pos + nbytes);
+    pos += nbytes;
+  }
+}
+
+std::vector<unsigned char> TileMap::serialize() const {
+  std::vector<unsigned char> ret(12);
+  write_u64(&ret[0], tile_map_magic);
+  write_u32(&ret[8], levels.size());
+  for (unsigned level = 0; level < levels.size(); level++) {
+    size_t pos = ret.size();
+    ret.resize(pos + 8);
+    write_u32(&ret[pos], levels[level].cols);
+    write_u32(&ret[pos + 4], levels[level].rows);
+    ret.insert(ret.end(), levels[level].bits.begin(), levels[level].bits.end());
+  }
+  return ret;
+}
+
+bool TileMap::same_grid(const TileMap &other) const {
+  if (levels.size() != other.levels.size()) return false;
+  for (unsigned level = 0; level < levels.size(); level++) {
+    if (levels[level].cols != other.levels[level].cols || levels[level].rows != other.levels[level].rows) return false;
+  }
+  return true;
+}
+
+bool TileMap::exists(int level, int x, int y) const {
+  if (level < 0 || level >= (int) levels.size()) return false;
+  const Level &l = levels[level];
+  if (x < 0 || y < 0 || x >= (int) l.cols || y >= (int) l.rows) return false;
+  size_t bit = (size_t) y * l.cols + x;
+  return (l.bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+void TileMap::set(int level, int x, int y) {
+  assert(level >= 0 && level < (int) levels.size());
+  Level &l = levels[level];
+  assert(x >= 0 && y >= 0 && x < (int) l.cols && y < (int) l.rows);
+  size_t bit = (size_t) y * l.cols + x;
+  l.bits[bit / 8] |= 1 << (bit % 8);
+}
+
+size_t TileMap::count() const {
+  size_t ret = 0;
+  for (unsigned level = 0; level < levels.size(); level++) {
+    for (unsigned i = 0; i < levels[level].bits.size(); i++) {
+      for (unsigned char b = levels[level].bits[i]; b; b &= b - 1) ret++;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef TILE_MAP_H
+#define TILE_MAP_H
+
+#include <string>
+#include <vector>
+
+// Which tiles of a stackset exist, as one bitmap per level, so that renderers can skip missing
+// tiles (past the edges of the image, or holes in sparse sources) without trying to open them.
+// Stored next to r.json as r.tilemap;  tilestacktool --write-tile-map writes it, either from the
+// tiles a build plans to create, before creating them, or from the tiles found.  Layout, integers
+// little-endian:
+//   u64 'tstilmp1', u32 nlevels, then per level:  u32 columns, u32 rows, bitmap (row-major, LSB first)
+// Levels are numbered as in GPTileIdx, 0 being the single tile at the top of the pyramid.
+
+class TileMap {
+  struct Level {
+    unsigned cols, rows;
+    std::vector<unsigned char> bits;
+  };
+  std::vector<Level> levels;
+public:
+  static std::string path(const std::string &stackset) { return stackset + "/r.tilemap"; }
+
+  // All tiles missing, for a pyramid of nlevels over width x height pixels
+  TileMap(int nlevels, int width, int height, int tile_width, int tile_height);
+  // Parses a serialized map;  throws if invalid
+  TileMap(const std::vector<unsigned char> &serialized);
+  std::vector<unsigned char> serialize() const;
+
+  int nlevels() const { return levels.size(); }
+  unsigned cols(int level) const { return levels[level].cols; }
+  unsigned rows(int level) const { return levels[level].rows; }
+  // True if other has the same levels with the same tile grids
+  bool same_grid(const TileMap &other) const;
+  bool exists(int level, int x, int y) const;
+  void set(int level, int x, int y);
+  size_t count() const;
+};
+
+#endif
@@ -1,5 +1,17 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
 #include "Tilestack.h"
-#include "SimpleZlib.h"
+#include "FrameCodec.h"
+#include "ThreadPool.h"
+#include "simple_shared_ptr.h"
 
 ResidentTilestack::ResidentTilestack(const TilestackInfo &ti)
 {
@@ -19,10 +31,284 @@ ResidentTilestack::ResidentTilestack(const TilestackInfo &ti)
   }
 }
 
-void Tilestack::write(Writer *w) const {
-  unsigned long long filepos = 0;
+unsigned long long Tilestack::use_clock;
+
+void Tilestack::instantiate_frame(unsigned frame) const {
+  FrameCache::Instantiation instantiation;
+  instantiate_pixels(frame);
+}
+
+std::list<FrameCache::Entry> FrameCache::entries;
+size_t FrameCache::bytes_used;
+int FrameCache::instantiation_depth;
+unsigned long long FrameCache::instantiation_start;
+size_t FrameCache::budget = 512 * 1024 * 1024;
+
+FrameCache::Instantiation::Instantiation() {
+  if (!instantiation_depth++) instantiation_start = Tilestack::use_clock + 1;
+}
+
+FrameCache::Instantiation::~Instantiation() {
+  instantiation_depth--;
+}
+
+void FrameCache::make_room(size_t bytes) {
+  // An entry used since it was placed is moved to the front once;  frames still in use may be moved
+  // again, so stop after two passes
+  size_t max_examined = 2 * entries.size();
+  for (size_t examined = 0; !entries.empty() && bytes_used + bytes > budget && examined < max_examined; examined++) {
+    Entry &lru = entries.back();
+    unsigned long long last_use = std::max(lru.last_use, lru.owner->last_use[lru.frame]);
+    bool in_use = lru.pins || (instantiation_depth && last_use >= instantiation_start);
+    if (last_use > lru.last_use || in_use) {
+      // Used since it was last placed;  move to front
+      lru.last_use = last_use;
+      entries.splice(entries.begin(), entries, --entries.end());
+      continue;
+    }
+    if (lru.partial) {
+      lru.owner->evict_partial(lru.frame);
+    } else {
+      lru.owner->evict(lru.frame);
+    }
+  }
+}
+
+FrameCache::iterator FrameCache::insert(const LRUTilestack *owner, unsigned frame, size_t bytes, bool partial) {
+  make_room(bytes);
+  Entry entry;
+  entry.owner = owner;
+  entry.frame = frame;
+  entry.partial = partial;
+  entry.pins = 0;
+  entry.bytes = bytes;
+  entry.last_use = ++Tilestack::use_clock;
+  entries.push_front(entry);
+  bytes_used += bytes;
+  return entries.begin();
+}
+
+void FrameCache::erase(iterator entry) {
+  bytes_used -= entry->bytes;
+  entries.erase(entry);
+}
+
+void FrameCache::pin(iterator entry) {
+  entry->pins++;
+}
+
+void FrameCache::unpin(iterator entry) {
+  assert(entry->pins);
+  entry->pins--;
+}
+
+std::map<std::string, FrameCacheCounters> &FrameCache::type_counters() {
+  static std::map<std::string, FrameCacheCounters> counters;
+  return counters;
+}
+
+FrameCacheCounters &FrameCache::counters(const std::type_info &type) {
+  std::string name = type.name();
+#ifdef __GNUC__
+  int status;
+  char *demangled = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+  if (demangled) {
+    name = demangled;
+    free(demangled);
+  }
+#endif
+  return type_counters()[name];
+}
+
+std::string FrameCache::stats() {
+  std::string ret = string_printf("Frame cache: %.1f of %.1f MB used.",
+                                  bytes_used / 1048576.0, budget / 1048576.0);
+  std::map<std::string, FrameCacheCounters> &counters = type_counters();
+  for (std::map<std::string, FrameCacheCounters>::iterator i = counters.begin(); i != counters.end(); ++i) {
+    unsigned long long lookups = i->second.hits + i->second.misses;
+    ret += string_printf("\n  %s: %llu hits, %llu misses (%.0f%% hit rate), %llu evictions", i->first.c_str(),
+                         i->second.hits, i->second.misses, lookups ? 100.0 * i->second.hits / lookups : 0.0,
+                         i->second.evictions);
+  }
+  return ret;
+}
+
+std::list<CompressedFrameCache::Entry> CompressedFrameCache::entries;
+std::map<CompressedFrameCache::Key, std::list<CompressedFrameCache::Entry>::iterator> CompressedFrameCache::index;
+size_t CompressedFrameCache::bytes_used;
+unsigned long long CompressedFrameCache::hits;
+unsigned long long CompressedFrameCache::misses;
+unsigned long long CompressedFrameCache::evictions;
+std::mutex CompressedFrameCache::mutex;
+size_t CompressedFrameCache::budget = 256 * 1024 * 1024;
+
+bool CompressedFrameCache::lookup(const void *owner, unsigned frame, std::vector<unsigned char> &dest) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<Key, std::list<Entry>::iterator>::iterator i = index.find(Key(owner, frame));
+  if (i == index.end()) {
+    misses++;
+    return false;
+  }
+  hits++;
+  entries.splice(entries.begin(), entries, i->second);
+  dest = i->second->data;
+  return true;
+}
+
+void CompressedFrameCache::insert(const void *owner, unsigned frame, const unsigned char *data, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (length > budget || index.count(Key(owner, frame))) return;
+  while (bytes_used + length > budget) {
+    bytes_used -= entries.back().data.size();
+    index.erase(entries.back().key);
+    entries.pop_back();
+    evictions++;
+  }
+  entries.push_front(Entry());
+  entries.front().key = Key(owner, frame);
+  entries.front().data.assign(data, data + length);
+  index[Key(owner, frame)] = entries.begin();
+  bytes_used += length;
+}
+
+void CompressedFrameCache::erase(const void *owner) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<Key, std::list<Entry>::iterator>::iterator i = index.lower_bound(Key(owner, 0));
+  while (i != index.end() && i->first.first == owner) {
+    bytes_used -= i->second->data.size();
+    entries.erase(i->second);
+    index.erase(i++);
+  }
+}
+
+std::string CompressedFrameCache::stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string ret = string_printf("Compressed frame cache: %.1f of %.1f MB used.",
+                                  bytes_used / 1048576.0, budget / 1048576.0);
+  if (hits + misses) {
+    ret += string_printf("  %llu hits, %llu misses (%.0f%% hit rate), %llu evictions",
+                         hits, misses, 100.0 * hits / (hits + misses), evictions);
+  }
+  return ret;
+}
+
+void LRUTilestack::insert(unsigned frame, unsigned char *frame_pixels) const {
+  if (!cache_counters) cache_counters = &FrameCache::counters(typeid(*this));
+  cache_counters->misses++;
+  cached[frame] = FrameCache::insert(this, frame, bytes_per_frame());
+  pixels[frame] = frame_pixels;
+}
+
+void LRUTilestack::pin_frame(unsigned frame) const {
+  std::map<unsigned, FrameCache::iterator>::iterator i = cached.find(frame);
+  assert(i != cached.end());
+  FrameCache::pin(i->second);
+}
+
+void LRUTilestack::unpin_frame(unsigned frame) const {
+  std::map<unsigned, FrameCache::iterator>::iterator i = cached.find(frame);
+  assert(i != cached.end());
+  FrameCache::unpin(i->second);
+}
+
+void LRUTilestack::evict(unsigned frame) const {
+  std::map<unsigned, FrameCache::iterator>::iterator i = cached.find(frame);
+  assert(i != cached.end());
+  FrameCache::erase(i->second);
+  cached.erase(i);
+  if (!borrowed.erase(frame)) delete[] pixels[frame];
+  pixels[frame] = 0;
+  if (cache_counters) cache_counters->evictions++;
+}
+
+LRUTilestack::~LRUTilestack() {
+  while (!cached.empty()) {
+    unsigned frame = cached.begin()->first;
+    FrameCache::erase(cached.begin()->second);
+    cached.erase(cached.begin());
+    if (!borrowed.erase(frame)) delete[] pixels[frame];
+    pixels[frame] = 0;
+  }
+}
 
-  // Write compressed with zlib
+FrameStats FrameStats::compute(const unsigned char *pixels, const TilestackInfo &info) {
+  FrameStats stats;
+  stats.all_zero = true;
+  stats.min.assign(info.bands_per_pixel, 0);
+  stats.max.assign(info.bands_per_pixel, 0);
+  stats.mean.assign(info.bands_per_pixel, 0);
+  size_t npixels = (size_t) info.tile_width * info.tile_height;
+  size_t bytes_per_pixel = info.bytes_per_pixel();
+  for (unsigned band = 0; band < info.bands_per_pixel; band++) {
+    double min = 0, max = 0, sum = 0;
+    const unsigned char *pixel = pixels;
+    for (size_t i = 0; i < npixels; i++, pixel += bytes_per_pixel) {
+      double val = info.get_pixel_band(pixel, band);
+      if (i == 0 || val < min) min = val;
+      if (i == 0 || val > max) max = val;
+      sum += val;
+    }
+    stats.min[band] = min;
+    stats.max[band] = max;
+    stats.mean[band] = npixels ? sum / npixels : 0;
+  }
+  size_t nbytes = info.bytes_per_frame();
+  for (size_t i = 0; i < nbytes && stats.all_zero; i++) stats.all_zero = !pixels[i];
+  return stats;
+}
+
+namespace {
+  // Statistics of a frame as readers will decode it;  info has the format compressed_frame was written in
+  FrameStats stored_frame_stats(const unsigned char *pixels, const std::vector<unsigned char> &compressed_frame,
+                                const TilestackInfo &info, const unsigned char *previous) {
+    if (!FrameCodec::is_lossy(info)) return FrameStats::compute(pixels, info);
+    std::vector<unsigned char> decoded(info.bytes_per_frame());
+    FrameCodec::decode(&decoded[0], &compressed_frame[0], compressed_frame.size(), info, previous);
+    return FrameStats::compute(&decoded[0], info);
+  }
+
+  struct CompressFrameJob {
+    const TilestackInfo &info;
+    const TilestackWriteOptions &options;
+    std::vector<unsigned char> frame;
+    std::vector<unsigned char> previous; // for temporal formats, unless frame is a keyframe
+    std::vector<unsigned char> compressed_frame;
+    FrameStats stats;
+    std::future<void> done;
+    CompressFrameJob(const TilestackInfo &info, const TilestackWriteOptions &options) :
+      info(info), options(options) {}
+    void run() {
+      const unsigned char *prev = previous.empty() ? NULL : &previous[0];
+      FrameCodec::encode(compressed_frame, &frame[0], info, options, prev);
+      if (options.frame_stats) stats = stored_frame_stats(&frame[0], compressed_frame, info, prev);
+    }
+  };
+
+  // Two independent 64-bit hashes and the length of a compressed frame, to find candidate identical frames
+  struct FrameDigest {
+    unsigned long long h1, h2, length;
+    FrameDigest(const std::vector<unsigned char> &data) : h1(0xcbf29ce484222325ULL), h2(0), length(data.size()) {
+      for (size_t i = 0; i < data.size(); i++) {
+        h1 = (h1 ^ data[i]) * 0x100000001b3ULL;        // FNV-1a
+        h2 = (h2 + data[i] + 1) * 0x9e3779b97f4a7c15ULL; // multiplicative (golden ratio)
+        h2 ^= h2 >> 29;
+      }
+    }
+    bool operator<(const FrameDigest &rhs) const {
+      if (h1 != rhs.h1) return h1 < rhs.h1;
+      if (h2 != rhs.h2) return h2 < rhs.h2;
+      return length < rhs.length;
+    }
+  };
+
+  struct StoredFrame {
+    unsigned frame;
+    std::vector<unsigned char> data;
+  };
+}
+
+void Tilestack::write(Writer *w, const TilestackWriteOptions &options) const {
+  unsigned long long filepos = 0;
 
   std::vector<unsigned char> header(8);
   write_u64(&header[0], 0x326b7473656c6974LL); // ASCII 'tilestk2'
@@ -32,15 +318,92 @@ void Tilestack::write(Writer *w) const {
   std::vector<unsigned char> buf;
   unsigned flush_threshold = 24 * 1024 * 1024; // Buffer ~24 MB before flushing
 
-  std::vector<unsigned char> compressed_frame;
-
   std::vector<TOCEntry> write_toc(nframes);
 
+  // Frames are instantiated in order on this thread, copied (instantiation may evict earlier frames),
+  // and compressed by the pool.  Compressed frames are appended strictly in frame order, so the
+  // output is identical to compressing serially.
+  unsigned nthreads = std::min(ThreadPool::default_size(), nframes);
+  simple_shared_ptr<ThreadPool> pool(nthreads > 1 ? new ThreadPool(nthreads) : NULL);
+  std::deque<simple_shared_ptr<CompressFrameJob> > jobs;
+  unsigned next_frame = 0;
+
+  // Temporal formats code each frame against a copy of the one before, except at keyframes
+  TilestackInfo info = *this;
+  info.compression_format = options.compression_format;
+  bool temporal = FrameCodec::is_temporal(info);
+  unsigned keyframe_interval = std::max(1U, options.keyframe_interval);
+  std::vector<unsigned char> previous_frame;
+
+  // Identical compressed frames are stored once, with their TOC entries sharing address and length.
+  // Frames are only shared after comparing bytes, so the bytes of recently stored frames are kept,
+  // within a budget;  a frame identical to one whose bytes were dropped is just stored again
+  std::map<FrameDigest, StoredFrame> stored_frames;
+  std::deque<FrameDigest> stored_order;
+  size_t stored_bytes = 0, stored_budget = 64 * 1024 * 1024;
+
+  // Extension block:  flags and per-band statistics of each frame, unless turned off
+  size_t stats_size = 4 + 24 * bands_per_pixel;
+  std::vector<unsigned char> extension;
+  if (options.frame_stats) {
+    extension.resize(EXTENSION_HEADER_SIZE + stats_size * nframes);
+    write_u32(&extension[0], nframes);
+    write_u32(&extension[4], bands_per_pixel);
+  }
+
   for (unsigned i = 0; i < nframes; i++) {
-    frame_pixels(i);
-    Zlib::compress(compressed_frame, pixels[i], bytes_per_frame());
-    buf.insert(buf.end(), compressed_frame.begin(), compressed_frame.end());
+    while (next_frame < nframes && next_frame < i + 2 * nthreads) {
+      simple_shared_ptr<CompressFrameJob> job(new CompressFrameJob(info, options));
+      const unsigned char *frame = frame_pixels(next_frame);
+      if (temporal && next_frame % keyframe_interval) job->previous = previous_frame;
+      if (pool.get()) {
+        job->frame.assign(frame, frame + bytes_per_frame());
+        job->done = pool->submit(std::bind(&CompressFrameJob::run, job.get()));
+      } else {
+        const unsigned char *prev = job->previous.empty() ? NULL : &job->previous[0];
+        FrameCodec::encode(job->compressed_frame, frame, info, options, prev);
+        if (options.frame_stats) job->stats = stored_frame_stats(frame, job->compressed_frame, info, prev);
+      }
+      if (temporal) previous_frame.assign(frame, frame + bytes_per_frame());
+      jobs.push_back(job);
+      next_frame++;
+    }
+    simple_shared_ptr<CompressFrameJob> job = jobs.front();
+    jobs.pop_front();
+    if (pool.get()) job->done.get();
+    const std::vector<unsigned char> &compressed_frame = job->compressed_frame;
+
+    if (options.frame_stats) {
+      unsigned char *frame_stats = &extension[EXTENSION_HEADER_SIZE + stats_size * i];
+      write_u32(frame_stats, job->stats.all_zero ? EXTENSION_FRAME_ALL_ZERO : 0);
+      for (unsigned band = 0; band < bands_per_pixel; band++) {
+        write_double64(frame_stats + 4 + 24 * band +  0, job->stats.min[band]);
+        write_double64(frame_stats + 4 + 24 * band +  8, job->stats.max[band]);
+        write_double64(frame_stats + 4 + 24 * band + 16, job->stats.mean[band]);
+      }
+    }
+
     write_toc[i].timestamp = toc[i].timestamp;
+    FrameDigest digest(compressed_frame);
+    std::map<FrameDigest, StoredFrame>::iterator stored = stored_frames.find(digest);
+    if (stored != stored_frames.end() && stored->second.data == compressed_frame) {
+      write_toc[i].address = write_toc[stored->second.frame].address;
+      write_toc[i].length = write_toc[stored->second.frame].length;
+      continue;
+    }
+    if (stored == stored_frames.end() && compressed_frame.size() <= stored_budget) {
+      while (stored_bytes + compressed_frame.size() > stored_budget) {
+        stored_bytes -= stored_frames[stored_order.front()].data.size();
+        stored_frames.erase(stored_order.front());
+        stored_order.pop_front();
+      }
+      StoredFrame &s = stored_frames[digest];
+      s.frame = i;
+      s.data = compressed_frame;
+      stored_order.push_back(digest);
+      stored_bytes += compressed_frame.size();
+    }
+    buf.insert(buf.end(), compressed_frame.begin(), compressed_frame.end());
     write_toc[i].address = filepos;
     write_toc[i].length = compressed_frame.size();
     filepos += compressed_frame.size();
@@ -52,6 +415,14 @@ void Tilestack::write(Writer *w) const {
   w->write(buf);
   buf.resize(0);
 
+  if (options.frame_stats) {
+    std::vector<unsigned char> extension_trailer(EXTENSION_TRAILER_SIZE);
+    write_u64(&extension_trailer[0], extension.size());
+    write_u64(&extension_trailer[8], EXTENSION_MAGIC);
+    w->write(extension);
+    w->write(extension_trailer);
+  }
+
   size_t tocentry_size = 24;
   std::vector<unsigned char> tocdata(tocentry_size * nframes);
   for (unsigned i = 0; i < nframes; i++) {
@@ -69,7 +440,7 @@ void Tilestack::write(Writer *w) const {
   write_u32(&footer[24], bands_per_pixel);
   write_u32(&footer[28], bits_per_band);
   write_u32(&footer[32], pixel_format);
-  write_u32(&footer[36], ZLIB_COMPRESSION);
+  write_u32(&footer[36], options.compression_format);
   write_u64(&footer[40], 0x646e65326b747374LL); // ASCII: 'tstk2end'
   w->write(footer);
 }
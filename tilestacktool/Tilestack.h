@@ -3,6 +3,13 @@
 
 #include <assert.h>
 
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <typeinfo>
+
 #include "io.h"
 #include "marshal.h"
 #include "mathutils.h"
@@ -96,7 +103,14 @@ struct TilestackInfo : public PixelInfo {
   unsigned int compression_format;
   enum CompressionFormat {
     NO_COMPRESSION = 0,
-    ZLIB_COMPRESSION = 1
+    ZLIB_COMPRESSION = 1,
+    JPEG_COMPRESSION = 2,        // Lossy;  8-bit integer, 1 or 3 bands only
+    ZLIB_BANDED_COMPRESSION = 3, // Horizontal bands compressed independently;  see FrameCodec.h
+    ZLIB_FILTERED_COMPRESSION = 4, // PNG-style row predictors before zlib;  see FrameCodec.h
+    ZLIB_DELTA_COMPRESSION = 5,    // Residual against previous frame, with periodic keyframes;  see FrameCodec.h
+    // Flag combined with ZLIB_COMPRESSION or ZLIB_DELTA_COMPRESSION:  bytes of each sample are
+    // grouped into planes before deflate (as Blosc's shuffle filter does), for 16-bit and wider samples
+    SHUFFLE_FLAG = 0x100
   };
   unsigned int bytes_per_frame() const { return bytes_per_pixel() * tile_width * tile_height; }
   std::string info() {
@@ -105,6 +119,42 @@ struct TilestackInfo : public PixelInfo {
   }
 };
 
+struct TilestackWriteOptions {
+  unsigned int compression_format;
+  unsigned int band_height; // rows per band, for ZLIB_BANDED_COMPRESSION
+  int jpeg_quality;         // 0-100, for JPEG_COMPRESSION
+  unsigned int keyframe_interval; // frames per keyframe, for ZLIB_DELTA_COMPRESSION
+  bool frame_stats;         // write the extension block of per-frame statistics
+  TilestackWriteOptions() : compression_format(TilestackInfo::ZLIB_COMPRESSION), band_height(32), jpeg_quality(90),
+                            keyframe_interval(16), frame_stats(true) {}
+};
+
+// .ts2 files may carry an extension block between the last frame and the TOC, which readers
+// that only use the footer and TOC ignore.  Layout (little-endian):
+//   u32 nframes
+//   u32 bands
+//   per frame:  u32 flags (EXTENSION_FRAME_ALL_ZERO),  then per band:  double min, max, mean
+//   u64 length of the above
+//   u64 magic 'tstkext1'
+enum {
+  EXTENSION_HEADER_SIZE = 8,
+  EXTENSION_TRAILER_SIZE = 16,
+  EXTENSION_FRAME_ALL_ZERO = 1
+};
+const unsigned long long EXTENSION_MAGIC = 0x317478656b747374LL; // ASCII 'tstkext1'
+
+// Summary of one frame's pixels, stored per frame in the optional .ts2 extension block
+struct FrameStats {
+  bool all_zero;
+  std::vector<double> min, max, mean; // per band
+  static FrameStats compute(const unsigned char *pixels, const TilestackInfo &info);
+};
+
+struct FrameCacheCounters {
+  unsigned long long hits, misses, evictions;
+  FrameCacheCounters() : hits(0), misses(0), evictions(0) {}
+};
+
 class Tilestack : public TilestackInfo {
 public:
   struct TOCEntry {
@@ -113,6 +163,11 @@ public:
   };
   mutable std::vector<TOCEntry> toc;
   mutable std::vector<unsigned char*> pixels;
+  // Value of use_clock when each frame was last used, for FrameCache's recency order
+  mutable std::vector<unsigned long long> last_use;
+  static unsigned long long use_clock;
+
+  Tilestack() : cache_counters(NULL) {}
 
 public:
   double frame_timestamp(unsigned frame) {
@@ -121,24 +176,173 @@ public:
   }
   unsigned char *frame_pixels(unsigned frame) const {
     assert(frame < nframes);
-    if (!pixels[frame]) instantiate_pixels(frame);
+    if (!pixels[frame]) {
+      instantiate_frame(frame);
+    } else if (cache_counters) {
+      cache_counters->hits++;
+    }
+    last_use[frame] = ++use_clock;
     return pixels[frame];
   }
   void set_nframes(unsigned nframes) {
     this->nframes = nframes;
     toc.resize(nframes);
     pixels.resize(nframes);
+    last_use.resize(nframes);
   }
   unsigned char *frame_pixel(unsigned frame, unsigned x, unsigned y) const {
     return frame_pixels(frame) + bytes_per_pixel() * (x + y * tile_width);
   }
-  void write(Writer *w) const;
+  // frame_pixels' pointer stays valid through nested instantiations, but a later top-level frame_pixels
+  // call may evict the frame.  To hold it longer, pin it (see PinnedFrame);  the frame must be instantiated
+  virtual void pin_frame(unsigned frame) const {}
+  virtual void unpin_frame(unsigned frame) const {}
+  // Frame pixels in which at least rows [row_begin, row_end) are valid.  Tilestacks that can decode
+  // part of a frame override this to avoid decoding the other rows
+  virtual unsigned char *frame_rows(unsigned frame, unsigned row_begin, unsigned row_end) const {
+    return frame_pixels(frame);
+  }
+  // Statistics of frame, if known without instantiating it;  otherwise NULL
+  virtual const FrameStats *frame_stats(unsigned frame) const {
+    return NULL;
+  }
+  // True if frame is known to be all zeros without instantiating it
+  virtual bool frame_known_empty(unsigned frame) const {
+    const FrameStats *stats = frame_stats(frame);
+    return stats && stats->all_zero;
+  }
+  void write(Writer *w, const TilestackWriteOptions &options = TilestackWriteOptions()) const;
   virtual ~Tilestack() {}
 protected:
+  // Counters for this tilestack's type, if it keeps frames in FrameCache
+  mutable FrameCacheCounters *cache_counters;
+
+  void instantiate_frame(unsigned frame) const;
   virtual void instantiate_pixels(unsigned frame) const = 0;
   
 };
 
+// Frame of a tilestack, pinned for the lifetime of this object
+class PinnedFrame {
+  const Tilestack &tilestack;
+  unsigned frame;
+  PinnedFrame(const PinnedFrame&);
+  PinnedFrame &operator=(const PinnedFrame&);
+public:
+  unsigned char *const pixels;
+  PinnedFrame(const Tilestack &tilestack, unsigned frame) :
+    tilestack(tilestack), frame(frame), pixels(tilestack.frame_pixels(frame)) {
+    tilestack.pin_frame(frame);
+  }
+  ~PinnedFrame() {
+    tilestack.unpin_frame(frame);
+  }
+};
+
+class LRUTilestack;
+
+// Process-wide memory budget for frames held by LRUTilestacks.  When full, evicts the least recently
+// used frame (by Tilestack::last_use), except pinned frames and frames used since the outermost
+// instantiation in progress began, since callers may still hold pointers to them;  the budget may be
+// exceeded to keep those.
+class FrameCache {
+  struct Entry {
+    const LRUTilestack *owner;
+    unsigned frame;
+    bool partial; // a partially decoded frame (see LRUTilestack::evict_partial)
+    unsigned pins;
+    size_t bytes;
+    unsigned long long last_use; // as of when the entry was last moved to the front
+  };
+  static std::list<Entry> entries; // most recently used first, but promoted lazily
+  static size_t bytes_used;
+  static int instantiation_depth;
+  static unsigned long long instantiation_start;
+
+  static std::map<std::string, FrameCacheCounters> &type_counters();
+  static void make_room(size_t bytes);
+
+public:
+  typedef std::list<Entry>::iterator iterator;
+  static size_t budget;
+
+  static iterator insert(const LRUTilestack *owner, unsigned frame, size_t bytes, bool partial = false);
+  static void erase(iterator entry);
+  static void pin(iterator entry);
+  static void unpin(iterator entry);
+  static FrameCacheCounters &counters(const std::type_info &type);
+  static std::string stats();
+
+  // Marks the extent of a frame instantiation
+  class Instantiation {
+  public:
+    Instantiation();
+    ~Instantiation();
+  };
+};
+
+// Stored (compressed) bytes of recently read frames, typically ~10x smaller than decoded, so that frames
+// evicted from FrameCache can be inflated again without rereading the file.  Shared by all tilestacks
+// and safe to use from multiple threads
+class CompressedFrameCache {
+  typedef std::pair<const void*, unsigned> Key; // owner, frame
+  struct Entry {
+    Key key;
+    std::vector<unsigned char> data;
+  };
+  static std::list<Entry> entries; // most recently used first
+  static std::map<Key, std::list<Entry>::iterator> index;
+  static size_t bytes_used;
+  static unsigned long long hits, misses, evictions;
+  static std::mutex mutex;
+
+public:
+  static size_t budget;
+
+  // If frame of owner is cached, copy its stored bytes to dest and return true
+  static bool lookup(const void *owner, unsigned frame, std::vector<unsigned char> &dest);
+  static void insert(const void *owner, unsigned frame, const unsigned char *data, size_t length);
+  // Drop all frames of owner
+  static void erase(const void *owner);
+  static std::string stats();
+};
+
+// Tilestack whose frames are computed on demand and kept in FrameCache
+class LRUTilestack : public Tilestack {
+  mutable std::map<unsigned, FrameCache::iterator> cached;
+  mutable std::set<unsigned> borrowed;
+
+  void insert(unsigned frame, unsigned char *frame_pixels) const;
+
+public:
+  virtual void create(unsigned frame) const {
+    adopt(frame, new unsigned char[bytes_per_frame()]);
+  }
+
+  // Like create, but take ownership of frame_pixels, allocated with new[]
+  void adopt(unsigned frame, unsigned char *frame_pixels) const {
+    insert(frame, frame_pixels);
+  }
+
+  // Like create, but use pixels owned by someone else (e.g. a memory-mapped file), which must
+  // outlive this tilestack
+  void borrow(unsigned frame, unsigned char *frame_pixels) const {
+    insert(frame, frame_pixels);
+    borrowed.insert(frame);
+  }
+
+  virtual void pin_frame(unsigned frame) const;
+  virtual void unpin_frame(unsigned frame) const;
+
+  // Called by FrameCache
+  void evict(unsigned frame) const;
+  // Called by FrameCache for entries inserted with partial set, e.g. frames of which only some rows
+  // were decoded.  Must erase the entry
+  virtual void evict_partial(unsigned frame) const { assert(0); }
+
+  virtual ~LRUTilestack();
+};
+
 /*
 Options:
 
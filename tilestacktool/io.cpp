@@ -1,38 +1,243 @@
+#include <ctype.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
 #include "io.h"
 
+// FileAdvice
+
+bool FileAdvice::enabled = true;
+bool FileAdvice::drop_written = false;
+std::atomic<unsigned long long> FileAdvice::bytes_advised[NADVICE];
+
+void FileAdvice::count(int fd, size_t offset, size_t length, Advice advice) {
+#ifndef _WIN32
+  struct stat st;
+  if (!length && fstat(fd, &st) == 0 && (size_t) st.st_size > offset) length = st.st_size - offset;
+#endif
+  bytes_advised[advice] += length;
+}
+
+void FileAdvice::advise(int fd, size_t offset, size_t length, Advice advice) {
+#ifdef __linux__
+  if (!enabled || fd < 0) return;
+  const int flags[NADVICE] = { POSIX_FADV_WILLNEED, POSIX_FADV_SEQUENTIAL, POSIX_FADV_DONTNEED };
+  if (posix_fadvise(fd, offset, length, flags[advice]) == 0) count(fd, offset, length, advice);
+#endif
+}
+
+void FileAdvice::advise(FILE *f, size_t offset, size_t length, Advice advice) {
+#ifdef __linux__
+  if (enabled && f) advise(fileno(f), offset, length, advice);
+#endif
+}
+
+void FileAdvice::advise(const std::string &filename, size_t offset, size_t length, Advice advice) {
+#ifdef __linux__
+  if (!enabled) return;
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  advise(fd, offset, length, advice);
+  ::close(fd);
+#endif
+}
+
+void FileAdvice::advise_memory(const unsigned char *addr, size_t length, Advice advice) {
+#ifdef __linux__
+  if (!enabled || !length) return;
+  // madvise needs a page-aligned start
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t misalignment = (size_t) addr % page;
+  const int flags[NADVICE] = { MADV_WILLNEED, MADV_SEQUENTIAL, MADV_DONTNEED };
+  if (madvise((void*) (addr - misalignment), length + misalignment, flags[advice]) == 0) {
+    bytes_advised[advice] += length;
+  }
+#endif
+}
+
+void FileAdvice::drop_written_file(const std::string &filename) {
+#ifdef __linux__
+  if (!enabled) return;
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  // Dirty pages aren't dropped, so write them back first
+  fdatasync(fd);
+  advise(fd, 0, 0, DONTNEED);
+  ::close(fd);
+#endif
+}
+
+std::string FileAdvice::stats() {
+  return string_printf("Page cache hints: %.1f MB WILLNEED, %.1f MB SEQUENTIAL, %.1f MB DONTNEED.",
+                       bytes_advised[WILLNEED] / 1048576.0, bytes_advised[SEQUENTIAL] / 1048576.0,
+                       bytes_advised[DONTNEED] / 1048576.0);
+}
+
+// SubrangeReader
+
+SubrangeReader::SubrangeReader(simple_shared_ptr<Reader> reader, size_t offset, size_t length) :
+  reader(reader), offset(offset), len(length) {
+  if (offset > reader->length() || length > reader->length() - offset) {
+    throw_error("SubrangeReader: range %zd+%zd is beyond end of file", offset, length);
+  }
+}
+
+void SubrangeReader::read(unsigned char *dest, size_t pos, size_t length) {
+  if (pos > len || length > len - pos) {
+    throw_error("Error reading %zd bytes at position %zd of %zd byte subrange", length, pos, len);
+  }
+  reader->read(dest, offset + pos, length);
+}
+
+void SubrangeReader::read_batch(const std::vector<ReadRequest> &requests) {
+  std::vector<ReadRequest> shifted;
+  for (unsigned i = 0; i < requests.size(); i++) {
+    const ReadRequest &r = requests[i];
+    if (r.offset > len || r.length > len - r.offset) {
+      throw_error("Error reading %zd bytes at position %zd of %zd byte subrange", r.length, r.offset, len);
+    }
+    shifted.push_back(ReadRequest(r.dest, offset + r.offset, r.length));
+  }
+  reader->read_batch(shifted);
+}
+
+const unsigned char *SubrangeReader::map(size_t pos, size_t length) {
+  if (pos > len || length > len - pos) return NULL;
+  return reader->map(offset + pos, length);
+}
+
+void SubrangeReader::advise(size_t pos, size_t length, FileAdvice::Advice advice) {
+  if (pos >= len) return;
+  reader->advise(offset + pos, length ? std::min(length, len - pos) : len - pos, advice);
+}
+
+// LockedReader
+
+void LockedReader::read(unsigned char *dest, size_t pos, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex);
+  reader->read(dest, pos, length);
+}
+
+size_t LockedReader::length() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return reader->length();
+}
+
+void LockedReader::read_batch(const std::vector<ReadRequest> &requests) {
+  std::lock_guard<std::mutex> lock(mutex);
+  reader->read_batch(requests);
+}
+
+const unsigned char *LockedReader::map(size_t pos, size_t length) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return reader->map(pos, length);
+}
+
+void LockedReader::advise(size_t pos, size_t length, FileAdvice::Advice advice) {
+  std::lock_guard<std::mutex> lock(mutex);
+  reader->advise(pos, length, advice);
+}
+
+// Reader
+
 std::vector<unsigned char> Reader::read(size_t offset, size_t length) {
   std::vector<unsigned char> ret(length);
   read(&ret[0], offset, length);
   return ret;
 }
 
+void Reader::read_batch(const std::vector<ReadRequest> &requests) {
+  for (unsigned i = 0; i < requests.size(); i++) read(requests[i].dest, requests[i].offset, requests[i].length);
+}
+
 void Writer::write(const std::vector<unsigned char> &src) {
-  write(&src[0], src.size());
+  if (!src.empty()) write(&src[0], src.size());
+}
+
+// Function-local statics so that registration from other translation units' static
+// initializers doesn't depend on initialization order
+
+std::map<std::string, FileReader::Opener> &FileReader::openers() {
+  static std::map<std::string, Opener> openers;
+  return openers;
+}
+
+std::map<std::string, FileReader::Opener> &FileReader::scheme_openers() {
+  static std::map<std::string, Opener> openers;
+  return openers;
 }
 
-FileReader* (*FileReader::opener)(std::string filename);
+std::string FileReader::selected_opener = "stream";
+
+std::string FileReader::scheme(const std::string &uri) {
+  size_t colon = uri.find("://");
+  if (colon == std::string::npos || colon == 0) return "";
+  for (size_t i = 0; i < colon; i++) {
+    if (!isalnum((unsigned char) uri[i]) && !strchr("+-.", uri[i])) return "";
+  }
+  return uri.substr(0, colon);
+}
 
 FileReader *FileReader::open(std::string filename) {
-  if (!opener) throw_error("Nothing registered to handle FileReader::open");
-  return (*opener)(filename);
+  std::string uri_scheme = scheme(filename);
+  if (uri_scheme == "file") {
+    filename = filename.substr(strlen("file://"));
+  } else if (uri_scheme != "") {
+    std::map<std::string, Opener>::iterator i = scheme_openers().find(uri_scheme);
+    if (i == scheme_openers().end()) throw_error("No FileReader for %s:// (opening %s)", uri_scheme.c_str(), filename.c_str());
+    return (*i->second)(filename);
+  }
+  std::map<std::string, Opener>::iterator i = openers().find(selected_opener);
+  if (i == openers().end()) throw_error("Nothing registered to handle FileReader::open (%s)", selected_opener.c_str());
+  return (*i->second)(filename);
 }
 
-bool FileReader::register_opener(FileReader* (*o)(std::string filename)) {
-  if (opener) throw_error("Multiple handlers registered for FileReader::open");
-  opener = o;
+bool FileReader::register_opener(std::string name, Opener o) {
+  if (openers().count(name)) throw_error("Multiple handlers registered for FileReader::open (%s)", name.c_str());
+  openers()[name] = o;
   return true;
 }
 
+bool FileReader::register_scheme(std::string scheme, Opener o) {
+  if (scheme_openers().count(scheme)) throw_error("Multiple handlers registered for FileReader::open (%s://)", scheme.c_str());
+  scheme_openers()[scheme] = o;
+  return true;
+}
 
-FileWriter* (*FileWriter::opener)(std::string filename);
+void FileReader::select_opener(std::string name) {
+  if (!openers().count(name)) throw_error("No FileReader named '%s'", name.c_str());
+  selected_opener = name;
+}
+
+
+std::map<std::string, FileWriter::Opener> &FileWriter::openers() {
+  static std::map<std::string, Opener> openers;
+  return openers;
+}
+
+std::string FileWriter::selected_opener = "stream";
 
 FileWriter *FileWriter::open(std::string filename) {
-  if (!opener) throw_error("Nothing registered to handle FileWriter::open");
-  return (*opener)(filename);
+  std::map<std::string, Opener>::iterator i = openers().find(selected_opener);
+  if (i == openers().end()) throw_error("Nothing registered to handle FileWriter::open (%s)", selected_opener.c_str());
+  return (*i->second)(filename);
 }
 
-bool FileWriter::register_opener(FileWriter* (*o)(std::string filename)) {
-  if (opener) throw_error("Multiple handlers registered for FileWriter::open");
-  opener = o;
+bool FileWriter::register_opener(std::string name, Opener o) {
+  if (openers().count(name)) throw_error("Multiple handlers registered for FileWriter::open (%s)", name.c_str());
+  openers()[name] = o;
   return true;
 }
+
+void FileWriter::select_opener(std::string name) {
+  if (!openers().count(name)) throw_error("No FileWriter named '%s'", name.c_str());
+  selected_opener = name;
+}
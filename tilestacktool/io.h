@@ -1,45 +1,144 @@
 #ifndef IO_H
 #define IO_H
 
+#include <atomic>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <vector>
 
 #include "cpp_utils.h"
+#include "simple_shared_ptr.h"
+
+// Page cache hints (posix_fadvise, or madvise for mappings), counted in bytes by kind.  No-ops
+// where unsupported, or when disabled.  A length of 0 means to the end of the file
+class FileAdvice {
+public:
+  enum Advice { WILLNEED, SEQUENTIAL, DONTNEED, NADVICE };
+  static bool enabled;
+  static bool drop_written; // DONTNEED tilestacks once written
+
+  static void advise(int fd, size_t offset, size_t length, Advice advice);
+  static void advise(FILE *f, size_t offset, size_t length, Advice advice);
+  // Opens filename just to advise;  SEQUENTIAL then has no effect on other open files
+  static void advise(const std::string &filename, size_t offset, size_t length, Advice advice);
+  static void advise_memory(const unsigned char *addr, size_t length, Advice advice);
+  // Write back filename and drop it from the page cache
+  static void drop_written_file(const std::string &filename);
+  static std::string stats();
+private:
+  static std::atomic<unsigned long long> bytes_advised[NADVICE]; // advice is given from worker threads too
+  static void count(int fd, size_t offset, size_t length, Advice advice);
+};
 
 class Reader {
 public:
+  struct ReadRequest {
+    unsigned char *dest;
+    size_t offset, length;
+    ReadRequest(unsigned char *dest, size_t offset, size_t length) : dest(dest), offset(offset), length(length) {}
+  };
+
   virtual void read(unsigned char *dest, size_t offset, size_t length) = 0;
   virtual size_t length() = 0;
   std::vector<unsigned char> read(size_t offset, size_t length);
+  // Perform all the requests, in any order.  Readers that can have many reads in flight at once
+  // override this;  by default the requests are read one at a time
+  virtual void read_batch(const std::vector<ReadRequest> &requests);
+  // Pointer to bytes [offset, offset+length) held in place by the reader (e.g. memory-mapped),
+  // or NULL if the reader can only copy.  Valid for the lifetime of the reader.
+  virtual const unsigned char *map(size_t offset, size_t length) { return NULL; }
+  // Can read, read_batch and map be called from several threads at once?
+  virtual bool thread_safe() const { return false; }
+  // Hint how bytes [offset, offset+length) will be used;  length 0 means to the end
+  virtual void advise(size_t offset, size_t length, FileAdvice::Advice advice) {}
   virtual ~Reader() {}
 };
 
+// Bytes [offset, offset+length) of another reader, read as a whole file, e.g. one tilestack of a
+// LevelPack.  Shares the underlying reader, and is as thread-safe as it is
+class SubrangeReader : public Reader {
+  simple_shared_ptr<Reader> reader;
+  size_t offset, len;
+public:
+  SubrangeReader(simple_shared_ptr<Reader> reader, size_t offset, size_t length);
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual size_t length() { return len; }
+  virtual void read_batch(const std::vector<ReadRequest> &requests);
+  virtual const unsigned char *map(size_t pos, size_t length);
+  virtual bool thread_safe() const { return reader->thread_safe(); }
+  virtual void advise(size_t pos, size_t length, FileAdvice::Advice advice);
+};
+
+// Serializes calls to a reader that isn't thread-safe, so that it can be shared, e.g. by the
+// SubrangeReaders of a LevelPack
+class LockedReader : public Reader {
+  simple_shared_ptr<Reader> reader;
+  std::mutex mutex;
+public:
+  LockedReader(simple_shared_ptr<Reader> reader) : reader(reader) {}
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual size_t length();
+  virtual void read_batch(const std::vector<ReadRequest> &requests);
+  virtual const unsigned char *map(size_t pos, size_t length);
+  virtual bool thread_safe() const { return true; }
+  virtual void advise(size_t pos, size_t length, FileAdvice::Advice advice);
+};
+
 class Writer {
 public:
   virtual void write(const unsigned char *src, size_t length) = 0;
   void write(const std::vector<unsigned char> &src);
+  // Finish writing and close, throwing on any error.  Call before relying on the contents, e.g.
+  // before renaming a temporary file into place;  destructors close too, but can't report errors
+  virtual void close() {}
   virtual ~Writer() {}
 };
 
+// Collects everything written in memory
+class MemoryWriter : public Writer {
+public:
+  std::vector<unsigned char> data;
+  virtual void write(const unsigned char *src, size_t length) { data.insert(data.end(), src, src + length); }
+};
+
+// Openers are registered by name at static initialization time (see io_streamfile.cpp);
+// "stream" is used unless another is selected with select_opener.  URIs with a scheme
+// (e.g. http://host/path, mem://path) are instead dispatched to the opener registered for that
+// scheme with register_scheme, which is passed the whole URI.  file:// URIs are local filenames.
 class FileReader : public Reader {
-  static FileReader* (*opener)(std::string filename);
+public:
+  typedef FileReader* (*Opener)(std::string filename);
+private:
+  static std::map<std::string, Opener> &openers();
+  static std::map<std::string, Opener> &scheme_openers();
+  static std::string selected_opener;
 public:
   virtual void read(unsigned char *dest, size_t pos, size_t length) = 0;
   virtual size_t length() = 0;
   virtual ~FileReader() {}
 
   static FileReader *open(std::string filename);
-  static bool register_opener(FileReader* (*o)(std::string filename));
+  static bool register_opener(std::string name, Opener o);
+  static bool register_scheme(std::string scheme, Opener o);
+  static void select_opener(std::string name);
+  // Scheme of uri (e.g. "http"), or "" if uri is a plain filename
+  static std::string scheme(const std::string &uri);
 };
 
 class FileWriter : public Writer {
-  static FileWriter* (*opener)(std::string filename);
+public:
+  typedef FileWriter* (*Opener)(std::string filename);
+private:
+  static std::map<std::string, Opener> &openers();
+  static std::string selected_opener;
 public:
   virtual void write(const unsigned char *src, size_t length) = 0;
   virtual ~FileWriter() {}
 
   static FileWriter *open(std::string filename);
-  static bool register_opener(FileWriter* (*o)(std::string filename));
+  static bool register_opener(std::string name, Opener o);
+  static void select_opener(std::string name);
 };
 
 
@@ -0,0 +1,79 @@
+#include "io_asyncfile.h"
+#include "io_streamfile.h"
+
+// AsyncFileWriter
+
+size_t AsyncFileWriter::buffer_size = 8 * 1024 * 1024;
+
+AsyncFileWriter::AsyncFileWriter(FileWriter *out) : out(out), pending(false), stopping(false), closed(false) {}
+
+void AsyncFileWriter::work() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (1) {
+    while (!pending && !stopping) changed.wait(lock);
+    if (!pending) return;
+    lock.unlock();
+    std::exception_ptr write_error;
+    try {
+      out->write(&writing[0], writing.size());
+    } catch (...) {
+      write_error = std::current_exception();
+    }
+    lock.lock();
+    if (write_error && !error) error = write_error;
+    writing.clear();
+    pending = false;
+    changed.notify_all();
+  }
+}
+
+// Wait for the writer thread to finish the previous buffer, then give it the filled one
+void AsyncFileWriter::hand_off() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!thread.joinable()) thread = std::thread(&AsyncFileWriter::work, this);
+  while (pending) changed.wait(lock);
+  if (error) std::rethrow_exception(error);
+  filling.swap(writing);
+  pending = true;
+  changed.notify_all();
+}
+
+void AsyncFileWriter::write(const unsigned char *src, size_t length) {
+  if (closed) throw_error("AsyncFileWriter: write after close");
+  filling.insert(filling.end(), src, src + length);
+  if (filling.size() >= buffer_size) hand_off();
+}
+
+void AsyncFileWriter::close() {
+  if (closed) return;
+  closed = true;
+  if (thread.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (pending) changed.wait(lock);
+      stopping = true;
+      changed.notify_all();
+    }
+    thread.join();
+  }
+  if (error) std::rethrow_exception(error);
+  if (!filling.empty()) out->write(&filling[0], filling.size());
+  std::vector<unsigned char>().swap(filling);
+  out->close();
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+  try {
+    close();
+  } catch (std::exception &e) {
+    fprintf(stderr, "AsyncFileWriter: %s\n", e.what());
+  }
+}
+
+FileWriter *AsyncFileWriter::open(std::string filename) {
+  return new AsyncFileWriter(new StreamFileWriter(filename));
+}
+
+namespace {
+  bool reg1 = FileWriter::register_opener("async", AsyncFileWriter::open);
+}
@@ -0,0 +1,41 @@
+#ifndef IO_ASYNCFILE_H
+#define IO_ASYNCFILE_H
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "io.h"
+#include "simple_shared_ptr.h"
+
+// Write-behind FileWriter:  writes fill a buffer which, once buffer_size bytes are queued, is handed
+// to a writer thread while the caller fills a second buffer.  Files smaller than one buffer are
+// written on close without starting the thread.  Errors from the writer thread are rethrown by the
+// next write or by close, which returns only once everything is written and the file is closed.
+
+class AsyncFileWriter : public FileWriter {
+  simple_shared_ptr<FileWriter> out;
+  std::vector<unsigned char> filling, writing;
+  std::thread thread; // started on the first handoff
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool pending;       // writing holds data for the thread
+  bool stopping;
+  bool closed;
+  std::exception_ptr error;
+
+  void work();
+  void hand_off();
+public:
+  static size_t buffer_size;
+
+  AsyncFileWriter(FileWriter *out);
+  virtual void write(const unsigned char *src, size_t length);
+  virtual void close();
+  virtual ~AsyncFileWriter();
+
+  static FileWriter *open(std::string filename);
+};
+
+#endif
@@ -0,0 +1,326 @@
+#ifndef _WIN32
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "io_httpfile.h"
+
+// HttpFileReader
+
+std::map<std::string, std::vector<HttpFileReader::Connection*> > HttpFileReader::idle;
+std::mutex HttpFileReader::idle_mutex;
+std::atomic<int> HttpFileReader::requests;
+std::atomic<int> HttpFileReader::connections;
+std::atomic<unsigned long long> HttpFileReader::bytes_received;
+size_t HttpFileReader::min_request = 256 * 1024;
+size_t HttpFileReader::merge_gap = 64 * 1024;
+
+HttpFileReader::HttpFileReader(std::string uri) :
+  uri(uri), port("80"), conn(NULL), len(0), block_offset(0) {
+  std::string rest = uri.substr(strlen("http://"));
+  size_t slash = rest.find('/');
+  host = rest.substr(0, slash);
+  path = slash == std::string::npos ? "/" : rest.substr(slash);
+  size_t colon = host.rfind(':');
+  if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+    port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+  }
+  if (host.size() > 2 && host[0] == '[') host = host.substr(1, host.size() - 2);
+  if (host.empty()) throw_error("HttpFileReader: no host in %s", uri.c_str());
+
+  std::vector<unsigned char> body;
+  size_t first;
+  get(string_printf("bytes=-%zu", min_request), body, first, len);
+  block.swap(body);
+  block_offset = first;
+}
+
+bool HttpFileReader::acquire_connection() {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    std::vector<Connection*> &conns = idle[host + ":" + port];
+    if (!conns.empty()) {
+      conn = conns.back();
+      conns.pop_back();
+      return true;
+    }
+  }
+  int sock = -1;
+  struct addrinfo hints, *addrs;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+  if (err) throw_error("HttpFileReader: can't resolve %s (%s)", host.c_str(), gai_strerror(err));
+  for (struct addrinfo *addr = addrs; addr && sock < 0; addr = addr->ai_next) {
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock < 0) continue;
+    if (connect(sock, addr->ai_addr, addr->ai_addrlen) < 0) {
+      ::close(sock);
+      sock = -1;
+    }
+  }
+  freeaddrinfo(addrs);
+  if (sock < 0) throw_error("HttpFileReader: can't connect to %s:%s (%s)", host.c_str(), port.c_str(), strerror(errno));
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  struct timeval timeout = { 60, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  conn = new Connection(sock);
+  connections++;
+  return false;
+}
+
+void HttpFileReader::release_connection(bool keep_alive) {
+  if (!conn) return;
+  // Unread bytes would be taken as the next response
+  if (keep_alive && conn->recv_pos == conn->recv_end) {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    std::vector<Connection*> &conns = idle[host + ":" + port];
+    if (conns.size() < max_idle_per_host) {
+      conns.push_back(conn);
+      conn = NULL;
+      return;
+    }
+  }
+  disconnect();
+}
+
+void HttpFileReader::disconnect() {
+  if (!conn) return;
+  ::close(conn->sock);
+  delete conn;
+  conn = NULL;
+}
+
+bool HttpFileReader::send_all(const std::string &data) {
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+  for (size_t sent = 0; sent < data.size(); ) {
+    ssize_t n = send(conn->sock, data.data() + sent, data.size() - sent, flags);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+}
+
+bool HttpFileReader::fill_recv_buf() {
+  while (1) {
+    ssize_t n = recv(conn->sock, &conn->recv_buf[0], conn->recv_buf.size(), 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    conn->recv_pos = 0;
+    conn->recv_end = n;
+    return true;
+  }
+}
+
+// Reads a line, without its CRLF.  Returns false if the connection closed first
+bool HttpFileReader::read_line(std::string &line) {
+  line.clear();
+  while (1) {
+    if (conn->recv_pos == conn->recv_end && !fill_recv_buf()) return false;
+    char c = conn->recv_buf[conn->recv_pos++];
+    if (c == '\n') break;
+    if (c != '\r') line += c;
+  }
+  return true;
+}
+
+// Reads length bytes of body into dest.  Returns false if the connection closed first
+bool HttpFileReader::read_body(unsigned char *dest, size_t length) {
+  while (length) {
+    if (conn->recv_pos < conn->recv_end) {
+      size_t n = std::min(length, conn->recv_end - conn->recv_pos);
+      memcpy(dest, &conn->recv_buf[conn->recv_pos], n);
+      conn->recv_pos += n;
+      dest += n;
+      length -= n;
+    } else {
+      // Receive large remainders straight into place
+      ssize_t n = recv(conn->sock, dest, length, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      dest += n;
+      length -= n;
+    }
+  }
+  return true;
+}
+
+// GET with header Range: range.  Sets body to the bytes returned, first to the offset of body in the
+// file, and total to the file length.  Pooled connections the server has since closed are dropped,
+// ending with a fresh connection
+void HttpFileReader::get(const std::string &range, std::vector<unsigned char> &body, size_t &first, size_t &total) {
+  std::string request = string_printf("GET %s HTTP/1.1\r\nHost: %s\r\nRange: %s\r\n\r\n",
+                                      path.c_str(), host.c_str(), range.c_str());
+  std::string status;
+  while (1) {
+    bool reused = acquire_connection();
+    if (send_all(request) && read_line(status)) break;
+    disconnect();
+    status.clear();
+    if (!reused) break;
+  }
+  if (status.empty()) throw_error("HttpFileReader: no response from %s:%s for %s", host.c_str(), port.c_str(), uri.c_str());
+  requests++;
+
+  int code = 0;
+  char version[16];
+  if (sscanf(status.c_str(), "HTTP/%15s %d", version, &code) != 2) {
+    disconnect();
+    throw_error("HttpFileReader: bad status line '%s' for %s", status.c_str(), uri.c_str());
+  }
+  bool keep_alive = strcmp(version, "1.0") != 0;
+  long long content_length = -1, range_first = -1, range_total = -1;
+  bool chunked = false;
+  std::string line;
+  while (1) {
+    if (!read_line(line)) {
+      disconnect();
+      throw_error("HttpFileReader: connection closed in headers for %s", uri.c_str());
+    }
+    if (line.empty()) break;
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) continue;
+    std::string name = line.substr(0, colon);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    std::string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    if (name == "content-length") {
+      content_length = atoll(value.c_str());
+    } else if (name == "content-range") {
+      // bytes first-last/total, or bytes */total
+      long long last;
+      if (sscanf(value.c_str(), "bytes %lld-%lld/%lld", &range_first, &last, &range_total) != 3) {
+        range_first = 0;
+        sscanf(value.c_str(), "bytes */%lld", &range_total);
+      }
+    } else if (name == "connection") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      if (value == "close") keep_alive = false;
+      if (value == "keep-alive") keep_alive = true;
+    } else if (name == "transfer-encoding") {
+      chunked = true;
+    }
+  }
+
+  if (code == 416 && range_total == 0) {
+    // Empty file
+    if (content_length > 0) {
+      std::vector<unsigned char> discard(content_length);
+      read_body(&discard[0], content_length);
+    }
+    body.clear();
+    first = total = 0;
+  } else if ((code == 200 || code == 206) && !chunked) {
+    if (code == 206 && (range_first < 0 || range_total < 0 || content_length < 0)) {
+      disconnect();
+      throw_error("HttpFileReader: partial response without Content-Range and Content-Length for %s", uri.c_str());
+    }
+    if (content_length >= 0) {
+      body.resize(content_length);
+      if (!read_body(body.empty() ? NULL : &body[0], body.size())) {
+        disconnect();
+        throw_error("HttpFileReader: connection closed in body of %s", uri.c_str());
+      }
+    } else {
+      // Length given by closing the connection
+      body.clear();
+      keep_alive = false;
+      while (conn->recv_pos < conn->recv_end || fill_recv_buf()) {
+        body.insert(body.end(), &conn->recv_buf[conn->recv_pos], &conn->recv_buf[0] + conn->recv_end);
+        conn->recv_pos = conn->recv_end;
+      }
+    }
+    first = code == 206 ? range_first : 0;
+    total = code == 206 ? range_total : body.size();
+  } else {
+    disconnect();
+    if (chunked) throw_error("HttpFileReader: chunked responses unsupported (HTTP %d for %s)", code, uri.c_str());
+    throw_error("HttpFileReader: HTTP %d for %s", code, uri.c_str());
+  }
+  bytes_received += body.size();
+  release_connection(keep_alive);
+}
+
+// Make block hold bytes [pos, pos + length)
+void HttpFileReader::fetch(size_t pos, size_t length) {
+  std::vector<unsigned char> body;
+  size_t first, total;
+  get(string_printf("bytes=%zu-%zu", pos, pos + length - 1), body, first, total);
+  if (total != len) throw_error("HttpFileReader: %s changed length from %zu to %zu", uri.c_str(), len, total);
+  block.swap(body);
+  block_offset = first;
+  if (!in_block(pos, length)) throw_error("HttpFileReader: short response reading %s", uri.c_str());
+}
+
+void HttpFileReader::read(unsigned char *dest, size_t pos, size_t length) {
+  if (pos > len || length > len - pos) {
+    throw_error("Error reading %zd bytes from %s at position %zd", length, uri.c_str(), pos);
+  }
+  if (!length) return;
+  if (!in_block(pos, length)) fetch(pos, std::min(std::max(length, min_request), len - pos));
+  memcpy(dest, &block[pos - block_offset], length);
+}
+
+namespace {
+  bool by_offset(const Reader::ReadRequest &a, const Reader::ReadRequest &b) { return a.offset < b.offset; }
+}
+
+void HttpFileReader::read_batch(const std::vector<ReadRequest> &requests) {
+  std::vector<ReadRequest> sorted(requests);
+  std::sort(sorted.begin(), sorted.end(), by_offset);
+  for (size_t i = 0; i < sorted.size(); ) {
+    // Merge following requests within merge_gap of this range
+    size_t begin = sorted[i].offset, end = begin + sorted[i].length, j = i + 1;
+    while (j < sorted.size() && sorted[j].offset <= end + merge_gap) {
+      end = std::max(end, sorted[j].offset + sorted[j].length);
+      j++;
+    }
+    if (end > len) throw_error("Error reading %zd bytes from %s at position %zd", end - begin, uri.c_str(), begin);
+    if (end > begin && !in_block(begin, end - begin)) fetch(begin, end - begin);
+    for (; i < j; i++) read(sorted[i].dest, sorted[i].offset, sorted[i].length);
+  }
+}
+
+size_t HttpFileReader::length() {
+  return len;
+}
+
+HttpFileReader::~HttpFileReader() {
+  disconnect();
+}
+
+FileReader *HttpFileReader::open(std::string uri) {
+  return new HttpFileReader(uri);
+}
+
+std::string HttpFileReader::stats() {
+  if (!requests) return "";
+  return string_printf("HTTP: %d range requests over %d connections, %.1f MB received.",
+                       requests.load(), connections.load(), bytes_received / 1048576.0);
+}
+
+namespace {
+  bool reg1 = FileReader::register_scheme("http", HttpFileReader::open);
+}
+
+#endif
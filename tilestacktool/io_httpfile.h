@@ -0,0 +1,70 @@
+#ifndef IO_HTTPFILE_H
+#define IO_HTTPFILE_H
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "io.h"
+
+// Reads http://host[:port]/path URIs with HTTP/1.1 Range requests over persistent connections,
+// e.g. tilestacks of a stackset hosted on an object store.  Idle connections are pooled per host
+// and shared by all readers, so a stackset render connects once per host, not once per tilestack.  Opening fetches the end of the file,
+// which holds a tilestack's footer and TOC, along with the file length.  Reads are widened to at
+// least min_request bytes and the last response is kept, so that nearby small reads cost one round
+// trip;  read_batch merges requests less than merge_gap apart into single ranges.  Servers that
+// ignore Range are handled by keeping the whole file.  No https.  Not available on Windows.
+
+class HttpFileReader : public FileReader {
+  struct Connection {
+    int sock;
+    std::vector<char> recv_buf;
+    size_t recv_pos, recv_end;
+    Connection(int sock) : sock(sock), recv_buf(65536), recv_pos(0), recv_end(0) {}
+  };
+
+  std::string uri, host, port, path;
+  // Held only during a request;  otherwise idle in the pool
+  Connection *conn;
+  size_t len;
+  // Bytes [block_offset, block_offset + block.size()) of the file, from the last response
+  std::vector<unsigned char> block;
+  size_t block_offset;
+
+  // Idle connections by host:port
+  static std::map<std::string, std::vector<Connection*> > idle;
+  static std::mutex idle_mutex;
+  static const size_t max_idle_per_host = 16;
+
+  static std::atomic<int> requests, connections;
+  static std::atomic<unsigned long long> bytes_received;
+
+  // Sets conn to an idle connection to the server if any, returning true, or else a new one
+  bool acquire_connection();
+  // Returns conn to the pool, or closes it if not keep_alive
+  void release_connection(bool keep_alive);
+  void disconnect();
+  bool send_all(const std::string &data);
+  bool fill_recv_buf();
+  bool read_line(std::string &line);
+  bool read_body(unsigned char *dest, size_t length);
+  void get(const std::string &range, std::vector<unsigned char> &body, size_t &first, size_t &total);
+  void fetch(size_t pos, size_t length);
+  bool in_block(size_t pos, size_t length) const {
+    return pos >= block_offset && pos - block_offset <= block.size() && length <= block.size() - (pos - block_offset);
+  }
+public:
+  static size_t min_request;
+  static size_t merge_gap;
+
+  HttpFileReader(std::string uri);
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual void read_batch(const std::vector<ReadRequest> &requests);
+  size_t length();
+  virtual ~HttpFileReader();
+
+  static FileReader *open(std::string uri);
+  static std::string stats();
+};
+
+#endif
@@ -0,0 +1,53 @@
+#include <string.h>
+
+#include "io_memfile.h"
+#include "simple_shared_ptr.h"
+
+// MemoryFileReader
+
+MemoryFileReader::MemoryFileReader(const std::vector<unsigned char> &data, std::string uri) : data(data), uri(uri) {}
+
+void MemoryFileReader::read(unsigned char *dest, size_t pos, size_t length) {
+  if (length) memcpy(dest, map(pos, length), length);
+}
+
+const unsigned char *MemoryFileReader::map(size_t pos, size_t length) {
+  if (pos > data.size() || length > data.size() - pos) {
+    throw_error("Error reading %ld bytes from %s at position %ld", (long) length, uri.c_str(), (long) pos);
+  }
+  return data.empty() ? NULL : &data[pos];
+}
+
+size_t MemoryFileReader::length() {
+  return data.size();
+}
+
+// Entries are never removed, so readers can refer to them directly
+std::map<std::string, std::vector<unsigned char> > &MemoryFileReader::files() {
+  static std::map<std::string, std::vector<unsigned char> > files;
+  return files;
+}
+
+void MemoryFileReader::add(const std::string &name, const std::vector<unsigned char> &contents) {
+  if (files().count(name)) throw_error("mem://%s already exists", name.c_str());
+  files()[name] = contents;
+}
+
+FileReader *MemoryFileReader::open(std::string uri) {
+  std::string name = uri.substr(strlen("mem://"));
+  std::map<std::string, std::vector<unsigned char> >::iterator i = files().find(name);
+  if (i == files().end()) {
+    long long size = file_size(name);
+    if (size < 0) throw_error("MemoryFileReader: no %s in memory, and can't open %s", uri.c_str(), name.c_str());
+    std::vector<unsigned char> contents(size);
+    simple_shared_ptr<FileReader> in(FileReader::open(name));
+    if (size) in->read(&contents[0], 0, size);
+    i = files().insert(std::make_pair(name, std::vector<unsigned char>())).first;
+    i->second.swap(contents);
+  }
+  return new MemoryFileReader(i->second, uri);
+}
+
+namespace {
+  bool reg1 = FileReader::register_scheme("mem", MemoryFileReader::open);
+}
@@ -0,0 +1,27 @@
+#ifndef IO_MEMFILE_H
+#define IO_MEMFILE_H
+
+#include "io.h"
+
+// Reads mem://name URIs from an in-memory store, e.g. for benchmarking without disk or page
+// cache effects.  A name not yet in the store is loaded from the local file of that name on first
+// open (so mem:///data/stackset/r.json reads /data/stackset/r.json once) and kept for the life of
+// the process.  Like mmap, map() hands out pointers into the store.
+
+class MemoryFileReader : public FileReader {
+  const std::vector<unsigned char> &data;
+  std::string uri;
+  static std::map<std::string, std::vector<unsigned char> > &files();
+public:
+  MemoryFileReader(const std::vector<unsigned char> &data, std::string uri);
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual const unsigned char *map(size_t pos, size_t length);
+  virtual bool thread_safe() const { return true; }
+  size_t length();
+
+  // Store contents as mem://name;  name must not already be stored
+  static void add(const std::string &name, const std::vector<unsigned char> &contents);
+  static FileReader *open(std::string uri);
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io_mmapfile.h"
+
+// MmapFileReader
+
+MmapFileReader::MmapFileReader(std::string filename) : filename(filename), data(NULL), len(0) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw_error("MmapFileReader: error opening %s for reading (%s)\n", filename.c_str(), strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    ::close(fd);
+    throw_error("MmapFileReader: error reading size of %s (%s)\n", filename.c_str(), strerror(errno));
+  }
+  len = st.st_size;
+  if (len) {
+    // Read-only, so that frames borrowed from the mapping can't be modified in place;  a stray write
+    // faults rather than silently changing what later reads of the frame see
+    void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      throw_error("MmapFileReader: error mapping %s (%s)\n", filename.c_str(), strerror(errno));
+    }
+    data = (unsigned char*) addr;
+  }
+  ::close(fd);
+}
+
+void MmapFileReader::read(unsigned char *dest, size_t pos, size_t length) {
+  memcpy(dest, map(pos, length), length);
+}
+
+const unsigned char *MmapFileReader::map(size_t pos, size_t length) {
+  if (pos > len || length > len - pos) {
+    throw_error("Error reading %zd bytes from file %s at position %zd", length, filename.c_str(), pos);
+  }
+  return data + pos;
+}
+
+void MmapFileReader::advise(size_t pos, size_t length, FileAdvice::Advice advice) {
+  if (pos >= len) return;
+  if (!length || length > len - pos) length = len - pos;
+  FileAdvice::advise_memory(data + pos, length, advice);
+}
+
+size_t MmapFileReader::length() {
+  return len;
+}
+
+MmapFileReader::~MmapFileReader() {
+  if (data) munmap(data, len);
+}
+
+FileReader *MmapFileReader::open(std::string filename) {
+  return new MmapFileReader(filename);
+}
+
+namespace {
+  bool reg1 = FileReader::register_opener("mmap", MmapFileReader::open);
+}
+
+#endif
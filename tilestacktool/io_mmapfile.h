@@ -0,0 +1,25 @@
+#ifndef IO_MMAPFILE_H
+#define IO_MMAPFILE_H
+
+#include "io.h"
+
+// Maps the whole file read-only so that map() can hand out pointers directly into the page cache.
+// Frames borrowed from the mapping must not be written.  Not available on Windows.
+
+class MmapFileReader : public FileReader {
+  std::string filename;
+  unsigned char *data;
+  size_t len;
+public:
+  MmapFileReader(std::string filename);
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual const unsigned char *map(size_t pos, size_t length);
+  virtual bool thread_safe() const { return true; }
+  virtual void advise(size_t pos, size_t length, FileAdvice::Advice advice);
+  size_t length();
+  virtual ~MmapFileReader();
+
+  static FileReader *open(std::string filename);
+};
+
+#endif
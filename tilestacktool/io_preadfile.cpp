@@ -0,0 +1,232 @@
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#include "io_preadfile.h"
+
+// io_uring, driven with raw system calls (no liburing dependency)
+
+#ifdef HAVE_IO_URING
+struct PreadFileReader::Ring {
+  int fd;
+  unsigned sq_entries, cq_entries;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  Ring() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(NULL) {}
+
+  // Returns false if io_uring is unavailable (e.g. old kernel, or disallowed by seccomp)
+  bool setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return false;
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) return false;
+    if (single_mmap) {
+      cq_ptr = sq_ptr;
+    } else {
+      cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED) return false;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes_ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) return false;
+    sqes = (struct io_uring_sqe*) sqes_ptr;
+
+    sq_head =  (unsigned*) ((char*) sq_ptr + p.sq_off.head);
+    sq_tail =  (unsigned*) ((char*) sq_ptr + p.sq_off.tail);
+    sq_mask =  (unsigned*) ((char*) sq_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned*) ((char*) sq_ptr + p.sq_off.array);
+    cq_head =  (unsigned*) ((char*) cq_ptr + p.cq_off.head);
+    cq_tail =  (unsigned*) ((char*) cq_ptr + p.cq_off.tail);
+    cq_mask =  (unsigned*) ((char*) cq_ptr + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) ((char*) cq_ptr + p.cq_off.cqes);
+    return true;
+  }
+
+  ~Ring() {
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (fd >= 0) ::close(fd);
+  }
+};
+#else
+struct PreadFileReader::Ring {};
+#endif
+
+// PreadFileReader
+
+PreadFileReader::PreadFileReader(std::string filename) :
+  filename(filename), fd(-1), len(0), ring(NULL), ring_failed(false) {
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw_error("PreadFileReader: error opening %s for reading (%s)\n", filename.c_str(), strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    ::close(fd);
+    throw_error("PreadFileReader: error reading size of %s (%s)\n", filename.c_str(), strerror(errno));
+  }
+  len = st.st_size;
+}
+
+void PreadFileReader::check_range(size_t pos, size_t length) {
+  if (pos > len || length > len - pos) {
+    throw_error("Error reading %zd bytes from file %s at position %zd", length, filename.c_str(), pos);
+  }
+}
+
+void PreadFileReader::read(unsigned char *dest, size_t pos, size_t length) {
+  check_range(pos, length);
+  while (length) {
+    ssize_t nread = pread(fd, dest, length, pos);
+    if (nread < 0 && errno == EINTR) continue;
+    if (nread <= 0) {
+      throw_error("Error reading %zd bytes from file %s at position %zd (%s)", length, filename.c_str(), pos,
+                  nread < 0 ? strerror(errno) : "end of file");
+    }
+    dest += nread;
+    pos += nread;
+    length -= nread;
+  }
+}
+
+void PreadFileReader::read_batch(const std::vector<ReadRequest> &requests) {
+  for (unsigned i = 0; i < requests.size(); i++) check_range(requests[i].offset, requests[i].length);
+  if (requests.size() > 1 && read_batch_uring(requests)) return;
+  Reader::read_batch(requests);
+}
+
+// Returns false if the batch should be read with pread instead
+bool PreadFileReader::read_batch_uring(const std::vector<ReadRequest> &requests) {
+#ifdef HAVE_IO_URING
+  std::lock_guard<std::mutex> lock(ring_mutex);
+  if (ring_failed) return false;
+  if (!ring) {
+    ring = new Ring();
+    if (!ring->setup(64)) {
+      delete ring;
+      ring = NULL;
+      ring_failed = true;
+      return false;
+    }
+  }
+
+  // Requests the ring didn't finish are read with pread only once nothing is in flight, since pread
+  // may throw, and the kernel must not write to the caller's buffers after we return.  Errors
+  // (including kernels without IORING_OP_READ) and short reads are finished this way;  pread reports
+  // real errors
+  std::vector<std::pair<size_t, size_t> > unfinished; // request index, bytes already read
+  size_t next = 0, completed = 0;
+  bool enter_failed = false;
+  while (completed < next || (next < requests.size() && !enter_failed)) {
+    // Queue as many requests as fit in the submission ring, without overrunning the completion ring
+    unsigned tail = *ring->sq_tail;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (!enter_failed && next < requests.size() && tail - head < ring->sq_entries &&
+           next - completed < ring->cq_entries) {
+      unsigned index = tail & *ring->sq_mask;
+      struct io_uring_sqe *sqe = &ring->sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->off = requests[next].offset;
+      sqe->addr = (unsigned long) requests[next].dest;
+      sqe->len = requests[next].length;
+      sqe->user_data = next;
+      ring->sq_array[index] = index;
+      tail++;
+      next++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      if (!enter_failed) {
+        // Take back what the kernel didn't consume, to read with pread, and stop using the ring
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        next -= tail - head;
+        __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+        enter_failed = ring_failed = true;
+      }
+      // Completions of reads in flight are still posted;  any system call lets the kernel finish them
+      if (completed < next) usleep(1000);
+    }
+
+    unsigned cq_head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (cq_head != cq_tail) {
+      struct io_uring_cqe *cqe = &ring->cqes[cq_head & *ring->cq_mask];
+      size_t nread = cqe->res > 0 ? cqe->res : 0;
+      if (nread < requests[cqe->user_data].length) unfinished.push_back(std::make_pair((size_t) cqe->user_data, nread));
+      if (cqe->res == -EINVAL) ring_failed = true;
+      completed++;
+      cq_head++;
+    }
+    __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+  }
+
+  for (unsigned i = 0; i < unfinished.size(); i++) {
+    const ReadRequest &request = requests[unfinished[i].first];
+    size_t nread = unfinished[i].second;
+    read(request.dest + nread, request.offset + nread, request.length - nread);
+  }
+  // Requests not submitted once io_uring_enter failed
+  for (size_t i = next; i < requests.size(); i++) read(requests[i].dest, requests[i].offset, requests[i].length);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void PreadFileReader::advise(size_t pos, size_t length, FileAdvice::Advice advice) {
+  FileAdvice::advise(fd, pos, length, advice);
+}
+
+size_t PreadFileReader::length() {
+  return len;
+}
+
+PreadFileReader::~PreadFileReader() {
+  delete ring;
+  if (fd >= 0) ::close(fd);
+}
+
+FileReader *PreadFileReader::open(std::string filename) {
+  return new PreadFileReader(filename);
+}
+
+namespace {
+  bool reg1 = FileReader::register_opener("pread", PreadFileReader::open);
+}
+
+#endif
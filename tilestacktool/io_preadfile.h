@@ -0,0 +1,37 @@
+#ifndef IO_PREADFILE_H
+#define IO_PREADFILE_H
+
+#include <mutex>
+
+#include "io.h"
+
+// Reads with pread, which has no shared file position, so any number of threads may read at once.
+// On Linux, read_batch submits requests together through io_uring when the kernel allows it,
+// and otherwise falls back to one pread per request.  Not available on Windows.
+
+class PreadFileReader : public FileReader {
+  std::string filename;
+  int fd;
+  size_t len;
+
+  // io_uring submission and completion rings, set up on first read_batch
+  struct Ring;
+  Ring *ring;
+  bool ring_failed;
+  std::mutex ring_mutex;
+
+  bool read_batch_uring(const std::vector<ReadRequest> &requests);
+  void check_range(size_t pos, size_t length);
+public:
+  PreadFileReader(std::string filename);
+  virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual void read_batch(const std::vector<ReadRequest> &requests);
+  virtual bool thread_safe() const { return true; }
+  virtual void advise(size_t pos, size_t length, FileAdvice::Advice advice);
+  size_t length();
+  virtual ~PreadFileReader();
+
+  static FileReader *open(std::string filename);
+};
+
+#endif
@@ -1,8 +1,14 @@
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "io_streamfile.h"
 
 // StreamFileReader
 
-StreamFileReader::StreamFileReader(std::string filename) : f(filename.c_str(), std::ios::in | std::ios::binary), filename(filename) {
+StreamFileReader::StreamFileReader(std::string filename) :
+  f(filename.c_str(), std::ios::in | std::ios::binary), filename(filename), advice_fd(-1) {
   if (!f.good()) throw_error("StreamFileReader: error opening %s for reading\n", filename.c_str());
 }
 
@@ -20,6 +26,21 @@ void StreamFileReader::read(unsigned char *dest, size_t pos, size_t length) {
   }
 }
 
+void StreamFileReader::advise(size_t pos, size_t length, FileAdvice::Advice advice) {
+#ifndef _WIN32
+  // SEQUENTIAL would only apply to advice_fd, not the stream's descriptor
+  if (!FileAdvice::enabled || advice == FileAdvice::SEQUENTIAL) return;
+  if (advice_fd < 0) advice_fd = ::open(filename.c_str(), O_RDONLY);
+  FileAdvice::advise(advice_fd, pos, length, advice);
+#endif
+}
+
+StreamFileReader::~StreamFileReader() {
+#ifndef _WIN32
+  if (advice_fd >= 0) ::close(advice_fd);
+#endif
+}
+
 size_t StreamFileReader::length() {
   f.seekg(0, std::ios::end);
   return f.tellg();
@@ -30,7 +51,7 @@ FileReader *StreamFileReader::open(std::string filename) {
 }
 
 namespace {
-  bool reg1 = FileReader::register_opener(StreamFileReader::open);
+  bool reg1 = FileReader::register_opener("stream", StreamFileReader::open);
 }
 
 
@@ -51,10 +72,16 @@ void StreamFileWriter::write(const unsigned char *src, size_t length) {
   }
 }
 
+void StreamFileWriter::close() {
+  if (!f.is_open()) return;
+  f.close();
+  if (f.fail()) throw_error("Error closing %s", filename.c_str());
+}
+
 FileWriter *StreamFileWriter::open(std::string filename) {
   return new StreamFileWriter(filename);
 }
 
 namespace {
-  bool reg2 = FileWriter::register_opener(StreamFileWriter::open);
+  bool reg2 = FileWriter::register_opener("stream", StreamFileWriter::open);
 }
@@ -6,11 +6,13 @@
 class StreamFileReader : public FileReader {
   std::ifstream f;
   std::string filename;
+  int advice_fd; // opened on first advise and kept, since the stream's descriptor isn't accessible
 public:
   StreamFileReader(std::string filename);
   virtual void read(unsigned char *dest, size_t pos, size_t length);
+  virtual void advise(size_t pos, size_t length, FileAdvice::Advice advice);
   size_t length();
-  virtual ~StreamFileReader() {}
+  virtual ~StreamFileReader();
 
   static FileReader *open(std::string filename);
 };
@@ -21,6 +23,7 @@ class StreamFileWriter : public FileWriter {
 public:
   StreamFileWriter(std::string filename);
   virtual void write(const unsigned char *src, size_t length);
+  virtual void close();
   virtual ~StreamFileWriter() {}
 
   static FileWriter *open(std::string filename);
@@ -7,7 +7,9 @@
 
 #include <png.h>
 
+#include "io.h"
 #include "png_util.h"
+#include "simple_shared_ptr.h"
 
 using namespace std;
 
@@ -19,6 +21,16 @@ namespace {
     fprintf(stderr, "\nAborting\n");
     exit(1);
   }
+
+  void write_to_writer(png_structp p_str, png_bytep data, png_size_t length) {
+    try {
+      ((FileWriter*) png_get_io_ptr(p_str))->write(data, length);
+    } catch (std::exception &e) {
+      die("%s", e.what());
+    }
+  }
+
+  void flush_writer(png_structp p_str) {}
 };
 
 void write_png(const char *filename,
@@ -37,16 +49,18 @@ void write_png(const char *filename,
     die("Don't know how to create PNG file with bit depth %d", bit_depth);
   }
 
-  FILE *out = fopen(filename, "wb");
-  if (!out) {
-    die("Can't open %s for writing\n", filename);
+  simple_shared_ptr<FileWriter> out;
+  try {
+    out.reset(FileWriter::open(filename));
+  } catch (std::exception &e) {
+    die("%s", e.what());
   }
 
   png_structp p_str = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   assert(p_str);
   png_infop p_info = png_create_info_struct(p_str);
   assert(p_info);
-  png_init_io(p_str, out);
+  png_set_write_fn(p_str, out.get(), write_to_writer, flush_writer);
   png_set_IHDR(p_str, p_info, width, height,
                bit_depth, color_type, PNG_INTERLACE_NONE,
                PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -59,5 +73,10 @@ void write_png(const char *filename,
 
   png_write_image(p_str, &row_pointers[0]);
   png_write_end(p_str, NULL);
-  fclose(out);
+  png_destroy_write_struct(&p_str, &p_info);
+  try {
+    out->close();
+  } catch (std::exception &e) {
+    die("%s", e.what());
+  }
 }
@@ -8,11 +8,16 @@
 #include <errno.h>
 
 #ifndef _WIN32
+	#include <sys/resource.h>
 	#include <unistd.h>
 #endif
 
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -25,10 +30,19 @@
 #include "ImageWriter.h"
 
 #include "io.h"
+#include "io_memfile.h"
+#ifndef _WIN32
+#include "io_httpfile.h"
+#endif
+#include "LevelPack.h"
 
 #include "mwc.h"
+#include "FrameCodec.h"
 #include "SimpleZlib.h"
+#include "SharedFrameCache.h"
+#include "TileMap.h"
 #include "Tilestack.h"
+#include "ThreadPool.h"
 #include "tilestacktool.h"
 #include "warp.h"
 #include "H264Encoder.h"
@@ -41,6 +55,7 @@ const double PI = 4.0*atan(1.0);
 unsigned int tilesize = 512;
 bool create_parent_directories = false;
 bool delete_source_tiles = false;
+bool pack_levels = false;
 std::vector<std::string> source_tiles_to_delete;
 std::string render_js_path_override;
 
@@ -48,45 +63,54 @@ void usage(const char *fmt, ...);
 
 const char *version() { return "0.3.3"; }
 
-class LRUTilestack : public Tilestack {
-  unsigned int lru_size;
-  mutable std::list<int> lru;
-
-public:
-  LRUTilestack() : lru_size(5) {}
-
-  // Not really deleting the LRU, but rather the least recently created
-  // (to avoid the overhead of recording use)
-  void delete_lru() const {
-    delete[] pixels[lru.back()];
-    pixels[lru.back()] = 0;
-    lru.pop_back();
-  }
-
-  virtual void create(unsigned frame) const {
-    while (lru.size() > lru_size) delete_lru();
-    lru.push_front(frame);
-    pixels[frame] = new unsigned char[bytes_per_frame()];
-  }
-
-  virtual ~LRUTilestack() {
-    while (!lru.empty()) delete_lru();
-  }
-};
-
 class TilestackReader : public LRUTilestack {
   static int stacks_read;
   static int compressed_tiles_read;
   static int uncompressed_tiles_read;
+  static int zero_copy_tiles_read;
+  static int frame_reads;
+  static int coalesced_tiles_read;
+  static int partial_tiles_read;
+  static int bands_in_partial_tiles;
+  static int bands_inflated;
+  static int delta_tiles_read;
+  static int delta_frames_decoded;
+  static int shared_tiles_copied;
+  static int prefetched_tiles_read;
+  static std::atomic<int> shared_cache_tiles_read;
+  static std::atomic<size_t> prefetched_bytes;
+  static const unsigned max_partial_frames = 5;
+
+  // Coalesced readahead of consecutive frames
+  mutable std::vector<unsigned char> readahead;
+  mutable unsigned long long readahead_address;
+  mutable unsigned readahead_frames;
+  mutable int last_frame;
+  // Identifies this file in SharedFrameCache;  empty if not using it
+  std::string shared_cache_key;
 public:
   simple_shared_ptr<Reader> reader;
-
-  TilestackReader(simple_shared_ptr<Reader> reader) : reader(reader) {
+  static size_t coalesce_window; // max bytes per coalesced read;  0 disables
+  static size_t prefetch_budget; // max bytes of frames prefetched but not yet used, across all readers;  0 disables
+
+  // filename, if given, lets decoded frames be shared with other processes through SharedFrameCache;
+  // offset is where the tilestack starts within it, e.g. in a LevelPack
+  TilestackReader(simple_shared_ptr<Reader> reader, const std::string &filename = "", size_t offset = 0) :
+    readahead_address(0), readahead_frames(1), last_frame(-1), reader(reader),
+    last_requested_frame(-1), sequential_requests(0), temporal_frame_index(-1), last_partial_frame(NULL), last_partial_frame_index(0) {
     read();
+    if (SharedFrameCache::budget && !filename.empty() && compression_format != NO_COMPRESSION) {
+      shared_cache_key = SharedFrameCache::file_key(filename);
+      if (offset && !shared_cache_key.empty()) shared_cache_key += string_printf("@%zu", offset);
+    }
     stacks_read++;
   }
 
-  virtual ~TilestackReader() {}
+  virtual ~TilestackReader() {
+    while (!prefetched.empty()) discard_prefetched(prefetched.begin()->first);
+    while (!partial_frames.empty()) delete_partial_frame(partial_frames.begin()->first);
+    CompressedFrameCache::erase(this);
+  }
 
   static std::string stats() {
     int total_tiles_read = compressed_tiles_read + uncompressed_tiles_read;
@@ -98,14 +122,349 @@ public:
                              (double) total_tiles_read / stacks_read,
                              100.0 * compressed_tiles_read / total_tiles_read);
     }
+    if (zero_copy_tiles_read) {
+      stats += string_printf("  %d tiles read or decompressed in place from mapped file.", zero_copy_tiles_read);
+    }
+    if (coalesced_tiles_read) {
+      stats += string_printf("  %d tiles read with %d reads (%d reads saved by coalescing).",
+                             total_tiles_read - zero_copy_tiles_read, frame_reads, coalesced_tiles_read);
+    }
+    if (partial_tiles_read) {
+      stats += string_printf("  %d tiles partially decoded (%d bands inflated of %d).",
+                             partial_tiles_read, bands_inflated, bands_in_partial_tiles);
+    }
+    if (shared_tiles_copied) {
+      stats += string_printf("  %d tiles copied from an identical stored frame.", shared_tiles_copied);
+    }
+    if (prefetched_tiles_read) {
+      stats += string_printf("  %d tiles prefetched in background.", prefetched_tiles_read);
+    }
+    if (shared_cache_tiles_read) {
+      stats += string_printf("  %d tiles decoded by another process, from shared memory.", (int) shared_cache_tiles_read);
+    }
+    if (delta_tiles_read) {
+      stats += string_printf("  %d delta-coded tiles reconstructed by decoding %d frames.",
+                             delta_tiles_read, delta_frames_decoded);
+    }
     return stats;
   }
 
 protected:
+  // Returns the stored bytes of frame if they are already in memory, either in place in the reader
+  // (e.g. mmap, in which case in_place is set), in the readahead buffer, or in CompressedFrameCache.
+  // If access looks sequential, first reads this frame and the following adjacent frames with a single
+  // read into the readahead buffer.  Otherwise compressed frames are read into scratch, and uncompressed
+  // frames return NULL so that the caller can read the frame straight into place.  The returned bytes
+  // may live in scratch, which must be empty on entry and must outlive their use.
+  const unsigned char *resident_frame_data(unsigned frame, bool &in_place, std::vector<unsigned char> &scratch) const {
+    const TOCEntry &entry = toc[frame];
+    const unsigned char *mapped = reader->map(entry.address, entry.length);
+    in_place = (mapped != NULL);
+    if (mapped) {
+      zero_copy_tiles_read++;
+      return mapped;
+    }
+
+    bool sequential = (frame == (unsigned) (last_frame + 1));
+    last_frame = frame;
+    readahead_frames = sequential ? std::min(readahead_frames * 2, 1024U) : 1;
+
+    if (entry.address >= readahead_address &&
+        entry.address + entry.length <= readahead_address + readahead.size()) {
+      coalesced_tiles_read++;
+      // Hand the buffer to the caller along with its last frame;  stacksets keep many readers open
+      if (entry.address + entry.length == readahead_address + readahead.size()) readahead.swap(scratch);
+      std::vector<unsigned char> &buf = scratch.empty() ? readahead : scratch;
+      note_stored_frame_read(frame);
+      return &buf[entry.address - readahead_address];
+    }
+
+    std::vector<unsigned char>().swap(readahead);
+    bool compressed = (compression_format != NO_COMPRESSION);
+    if (compressed && CompressedFrameCache::lookup(this, frame, scratch)) return &scratch[0];
+    frame_reads++;
+    const unsigned char *data = NULL;
+    if (sequential && coalesce_window) data = coalesced_read(frame);
+    if (data) {
+      note_stored_frame_read(frame);
+    } else if (compressed) {
+      scratch = read_stored(entry.address, entry.length);
+      data = &scratch[0];
+      if (note_stored_frame_read(frame) || is_keyframe(frame, data)) {
+        CompressedFrameCache::insert(this, frame, data, entry.length);
+      }
+    }
+    return data;
+  }
+
+  // Frames whose stored bytes have been read from the file.  Only frames read again, and temporal
+  // keyframes, which random access decodes from, go into CompressedFrameCache;  caching every frame
+  // of a one-pass scan would only push out useful entries
+  mutable std::vector<bool> stored_frames_read;
+
+  // Returns true if frame was read before
+  bool note_stored_frame_read(unsigned frame) const {
+    if (stored_frames_read.empty()) stored_frames_read.resize(nframes);
+    bool again = stored_frames_read[frame];
+    stored_frames_read[frame] = true;
+    return again;
+  }
+
+  bool is_keyframe(unsigned frame, const unsigned char *data) const {
+    return FrameCodec::is_temporal(*this) && frame % FrameCodec::keyframe_interval(data, toc[frame].length) == 0;
+  }
+
+  // Read frame and the following frames that are adjacent in the file into the readahead buffer, and
+  // return frame's bytes.  Returns NULL if there are no such following frames
+  const unsigned char *coalesced_read(unsigned frame) const {
+    const TOCEntry &entry = toc[frame];
+
+    // Merge the TOC ranges of following frames that are adjacent in the file and neither instantiated
+    // nor already being prefetched
+    unsigned long long end = entry.address + entry.length;
+    unsigned last = frame;
+    while (last + 1 < nframes && last + 1 - frame < readahead_frames &&
+           toc[last + 1].address == end &&
+           end + toc[last + 1].length - entry.address <= coalesce_window &&
+           !pixels[last + 1] && !prefetched.count(last + 1)) {
+      last++;
+      end += toc[last].length;
+    }
+    if (last == frame) return NULL;
+
+    readahead.resize(end - entry.address);
+    read_stored(&readahead[0], entry.address, readahead.size());
+    readahead_address = entry.address;
+    // Have the next, probably doubled, window read in the background while this one is decoded
+    reader->advise(end, std::min(2 * readahead.size(), coalesce_window), FileAdvice::WILLNEED);
+    return &readahead[0];
+  }
+
+  // Per-frame statistics from the extension block;  empty if the file has none
+  std::vector<FrameStats> frame_statistics;
+
+  // Frames whose TOC entries share the same stored bytes, indexed by address;  only addresses used
+  // by more than one frame are present
+  std::map<unsigned long long, std::vector<unsigned> > shared_frames;
+
+  // Copy frame from a resident frame with the same stored bytes, if any.  Not for temporal formats,
+  // where identical stored residuals needn't mean identical pixels
+  bool copy_shared_frame(unsigned frame) const {
+    if (shared_frames.empty() || FrameCodec::is_temporal(*this)) return false;
+    std::map<unsigned long long, std::vector<unsigned> >::const_iterator shared = shared_frames.find(toc[frame].address);
+    if (shared == shared_frames.end()) return false;
+    for (unsigned i = 0; i < shared->second.size(); i++) {
+      unsigned other = shared->second[i];
+      if (other != frame && pixels[other] && toc[other].length == toc[frame].length) {
+        // Copy first, since create may evict other
+        std::vector<unsigned char> copy(pixels[other], pixels[other] + bytes_per_frame());
+        create(frame);
+        memcpy(pixels[frame], &copy[0], bytes_per_frame());
+        shared_tiles_copied++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Reader access is shared with prefetch tasks;  thread-safe readers (mmap, pread) skip the lock
+  mutable std::mutex reader_mutex;
+
+  std::vector<unsigned char> read_stored(unsigned long long address, size_t length) const {
+    std::unique_lock<std::mutex> lock(reader_mutex, std::defer_lock);
+    if (!reader->thread_safe()) lock.lock();
+    return reader->read(address, length);
+  }
+
+  void read_stored(unsigned char *dest, unsigned long long address, size_t length) const {
+    std::unique_lock<std::mutex> lock(reader_mutex, std::defer_lock);
+    if (!reader->thread_safe()) lock.lock();
+    reader->read(dest, address, length);
+  }
+
+  void read_stored_batch(const std::vector<Reader::ReadRequest> &requests) const {
+    std::unique_lock<std::mutex> lock(reader_mutex, std::defer_lock);
+    if (!reader->thread_safe()) lock.lock();
+    reader->read_batch(requests);
+  }
+
+  // Frames being decoded on the prefetch pool, ahead of sequential access.  Stored bytes are read
+  // beforehand, a run of adjacent frames at a time, into stored;  its refcount is only touched
+  // on the requesting thread
+  struct Prefetch {
+    unsigned char *pixels;
+    simple_shared_ptr<std::vector<unsigned char> > stored;
+    std::future<void> done;
+  };
+  mutable std::map<unsigned, Prefetch> prefetched;
+  mutable int last_requested_frame;
+  mutable unsigned sequential_requests; // consecutive frames requested in order
+
+  static ThreadPool &prefetch_pool() {
+    static ThreadPool pool(ThreadPool::default_size());
+    return pool;
+  }
+
+  // Decode frame into dest, from stored if not NULL
+  void prefetch_frame(unsigned frame, unsigned char *dest, const unsigned char *stored) const {
+    if (lookup_shared(frame, dest)) return;
+    const unsigned char *data = stored ? stored : reader->map(toc[frame].address, toc[frame].length);
+    std::vector<unsigned char> stored_frame;
+    if (!data) {
+      stored_frame = read_stored(toc[frame].address, toc[frame].length);
+      data = &stored_frame[0];
+    }
+    FrameCodec::decode(dest, data, toc[frame].length, *this);
+    if (!shared_cache_key.empty()) SharedFrameCache::insert(shared_cache_key, frame, dest, bytes_per_frame());
+  }
+
+  bool lookup_shared(unsigned frame, unsigned char *dest) const {
+    if (shared_cache_key.empty() || !SharedFrameCache::lookup(shared_cache_key, frame, dest, bytes_per_frame())) {
+      return false;
+    }
+    shared_cache_tiles_read++;
+    return true;
+  }
+
+  // If frame was decoded by any process using SharedFrameCache, make it resident
+  bool take_shared(unsigned frame) const {
+    if (shared_cache_key.empty() || partial_frames.count(frame)) return false;
+    unsigned char *frame_pixels = new unsigned char[bytes_per_frame()];
+    if (!lookup_shared(frame, frame_pixels)) {
+      delete[] frame_pixels;
+      return false;
+    }
+    adopt(frame, frame_pixels);
+    compressed_tiles_read++;
+    return true;
+  }
+
+  // On sequential access, queue decoding of the frames following frame, within prefetch_budget
+  void schedule_prefetch(unsigned frame) const {
+    bool sequential = (frame == (unsigned) (last_requested_frame + 1));
+    last_requested_frame = frame;
+    sequential_requests = sequential ? sequential_requests + 1 : 0;
+    if (sequential_requests == 3) {
+      // Looks like a scan through the stack
+      reader->advise(0, 0, FileAdvice::SEQUENTIAL);
+    }
+    // Drop finished prefetches that access has moved past
+    for (std::map<unsigned, Prefetch>::iterator i = prefetched.begin(); i != prefetched.end() && i->first < frame; ) {
+      unsigned f = (i++)->first;
+      if (prefetched[f].done.wait_for(std::chrono::seconds(0)) == std::future_status::ready) discard_prefetched(f);
+    }
+    // A first request of frame 0 isn't yet a scan
+    if (sequential_requests < 2 || !prefetch_budget || FrameCodec::is_temporal(*this)) return;
+    // Deep enough for batched reads even with few threads;  prefetch_budget bounds the memory
+    unsigned depth = std::max(2 * prefetch_pool().size(), 16U);
+    // Refill only once half the queue is used, so that stored bytes are read in batches
+    unsigned queued = 0;
+    for (unsigned f = frame + 1; f < nframes && f <= frame + depth; f++) queued += prefetched.count(f);
+    if (queued > depth / 2) return;
+    // Each run of frames adjacent in the file, within coalesce_window, is read with one request
+    std::vector<std::vector<unsigned> > runs;
+    for (unsigned f = frame + 1; f < nframes && f <= frame + depth; f++) {
+      if (pixels[f] || prefetched.count(f)) continue;
+      if (prefetched_bytes + bytes_per_frame() > prefetch_budget) break;
+      prefetched_bytes += bytes_per_frame();
+      const std::vector<unsigned> *run = runs.empty() ? NULL : &runs.back();
+      if (!run || f != run->back() + 1 ||
+          toc[f].address != toc[run->back()].address + toc[run->back()].length ||
+          toc[f].address + toc[f].length - toc[(*run)[0]].address > coalesce_window) {
+        runs.push_back(std::vector<unsigned>());
+      }
+      runs.back().push_back(f);
+    }
+    if (!runs.empty()) queue_prefetches(runs);
+  }
+
+  // Read the stored bytes of runs of frames adjacent in the file, submitting the reads together with
+  // read_batch, and queue their decoding.  Bytes already in the readahead buffer are taken from it
+  void queue_prefetches(const std::vector<std::vector<unsigned> > &runs) const {
+    std::vector<simple_shared_ptr<std::vector<unsigned char> > > stored(runs.size());
+    std::vector<Reader::ReadRequest> requests;
+    for (unsigned r = 0; r < runs.size(); r++) {
+      const std::vector<unsigned> &frames = runs[r];
+      unsigned long long start = toc[frames[0]].address;
+      unsigned long long end = toc[frames.back()].address + toc[frames.back()].length;
+      // Mapped readers need no read;  prefetch_frame maps
+      if (reader->map(start, end - start)) continue;
+      if (start >= readahead_address && end <= readahead_address + readahead.size()) {
+        stored[r].reset(new std::vector<unsigned char>(readahead.begin() + (start - readahead_address),
+                                                       readahead.begin() + (end - readahead_address)));
+      } else {
+        stored[r].reset(new std::vector<unsigned char>(end - start));
+        if (!stored[r]->empty()) requests.push_back(Reader::ReadRequest(&(*stored[r])[0], start, stored[r]->size()));
+        frame_reads++;
+      }
+      for (unsigned i = 0; i < frames.size(); i++) note_stored_frame_read(frames[i]);
+      coalesced_tiles_read += frames.size() - 1;
+    }
+    if (!requests.empty()) read_stored_batch(requests);
+    for (unsigned r = 0; r < runs.size(); r++) {
+      const std::vector<unsigned> &frames = runs[r];
+      for (unsigned i = 0; i < frames.size(); i++) {
+        unsigned f = frames[i];
+        Prefetch &p = prefetched[f];
+        p.pixels = new unsigned char[bytes_per_frame()];
+        p.stored = stored[r];
+        const unsigned char *data = stored[r].get() ? &(*stored[r])[toc[f].address - toc[frames[0]].address] : NULL;
+        p.done = prefetch_pool().submit(std::bind(&TilestackReader::prefetch_frame, this, f, p.pixels, data));
+      }
+    }
+  }
+
+  // If frame was prefetched, wait for it and make it resident
+  bool take_prefetched(unsigned frame) const {
+    std::map<unsigned, Prefetch>::iterator i = prefetched.find(frame);
+    if (i == prefetched.end()) return false;
+    try {
+      i->second.done.get();
+    } catch (...) {
+      discard_prefetched(frame);
+      throw;
+    }
+    adopt(frame, i->second.pixels);
+    prefetched.erase(i);
+    prefetched_bytes -= bytes_per_frame();
+    prefetched_tiles_read++;
+    (compression_format == NO_COMPRESSION ? uncompressed_tiles_read : compressed_tiles_read)++;
+    return true;
+  }
+
+  void discard_prefetched(unsigned frame) const {
+    Prefetch &p = prefetched[frame];
+    if (p.done.valid()) p.done.wait();
+    delete[] p.pixels;
+    prefetched.erase(frame);
+    prefetched_bytes -= bytes_per_frame();
+  }
+
   virtual void instantiate_pixels(unsigned frame) const {
     //fprintf(stderr, "TileStackReader %llx instantiating frame %d\n", (unsigned long long) this, frame);
     assert(!pixels[frame]);
-    create(frame);
+    schedule_prefetch(frame);
+    if (take_prefetched(frame)) return;
+    if (copy_shared_frame(frame)) return;
+    if (take_shared(frame)) return;
+    // Finish a frame partially decoded by frame_rows.  Take it out of partial_frames first, since
+    // making room for the frame may evict it
+    PartialFrame partial;
+    if (take_partial_frame(frame, partial)) {
+      create(frame);
+      memcpy(pixels[frame], &partial.pixels[0], bytes_per_frame());
+      for (unsigned band = 0; band < partial.decoded.size(); band++) {
+        if (!partial.decoded[band]) {
+          FrameCodec::decode_band(pixels[frame], band, partial.data, toc[frame].length, *this);
+          bands_inflated++;
+        }
+      }
+      if (!shared_cache_key.empty()) SharedFrameCache::insert(shared_cache_key, frame, pixels[frame], bytes_per_frame());
+      return;
+    }
+    bool in_place = false;
+    std::vector<unsigned char> readahead_scratch;
+    const unsigned char *data = resident_frame_data(frame, in_place, readahead_scratch);
     switch (compression_format) {
     case NO_COMPRESSION:
       uncompressed_tiles_read++;
@@ -113,24 +472,180 @@ protected:
         throw_error("TilestackReader: Frame %d has %d bytes, but should have %d bytes",
                     frame, (int) toc[frame].length, (int)bytes_per_frame());
       }
-      reader->read(pixels[frame], toc[frame].address, toc[frame].length);
+      if (in_place) {
+        borrow(frame, const_cast<unsigned char*>(data));
+      } else {
+        create(frame);
+        memcpy(pixels[frame], data, bytes_per_frame());
+      }
       break;
-    case ZLIB_COMPRESSION:
-      compressed_tiles_read++;
+    default:
+      create(frame);
       {
-        std::vector<unsigned char> compressed_frame = reader->read(toc[frame].address, toc[frame].length);
-        std::vector<unsigned char> uncompressed_frame;
-        Zlib::uncompress(uncompressed_frame, &compressed_frame[0], compressed_frame.size());
-        if (uncompressed_frame.size() != bytes_per_frame()) {
-          throw_error("TilestackReader: Frame %d has %d bytes, but should have %d bytes",
-                      frame, (int) uncompressed_frame.size(), (int)bytes_per_frame());
+        compressed_tiles_read++;
+        std::vector<unsigned char> stored_frame;
+        if (FrameCodec::is_temporal(*this)) {
+          if (!in_place) {
+            // Reading earlier frames may release the readahead buffer holding data
+            stored_frame.assign(data, data + toc[frame].length);
+            data = &stored_frame[0];
+          }
+          decode_temporal(frame, data);
+        } else {
+          FrameCodec::decode(pixels[frame], data, toc[frame].length, *this);
         }
-        std::copy(uncompressed_frame.begin(), uncompressed_frame.end(), pixels[frame]);
       }
       break;
-    default:
-      throw_error("Unknown compression type in tilestack: %d", compression_format);
-      break;
+    }
+    if (!shared_cache_key.empty()) SharedFrameCache::insert(shared_cache_key, frame, pixels[frame], bytes_per_frame());
+  }
+
+  // Last frame reconstructed from a temporal format, so that sequential access decodes only one
+  // delta per frame
+  mutable std::vector<unsigned char> temporal_frame;
+  mutable int temporal_frame_index;
+
+  // Reconstruct frame of a temporal format into pixels[frame], by decoding forward from the nearest
+  // keyframe, or from a later frame that is still resident
+  void decode_temporal(unsigned frame, const unsigned char *data) const {
+    delta_tiles_read++;
+    unsigned interval = FrameCodec::keyframe_interval(data, toc[frame].length);
+    unsigned begin = frame - frame % interval;
+    const unsigned char *previous = NULL;
+    for (unsigned f = frame; f > begin && !previous; f--) {
+      if (pixels[f - 1]) {
+        previous = pixels[f - 1];
+      } else if (temporal_frame_index == (int) f - 1) {
+        previous = &temporal_frame[0];
+      }
+      if (previous) begin = f;
+    }
+
+    std::vector<unsigned char> decoded, reconstructed;
+    for (unsigned f = begin; f < frame; f++) {
+      std::vector<unsigned char> storage;
+      bool in_place;
+      const unsigned char *stored = resident_frame_data(f, in_place, storage);
+      decoded.resize(bytes_per_frame());
+      FrameCodec::decode(&decoded[0], stored, toc[f].length, *this, previous);
+      decoded.swap(reconstructed);
+      previous = &reconstructed[0];
+      delta_frames_decoded++;
+    }
+    if (begin < frame) last_frame = frame; // keep readahead tracking the requested frames
+
+    FrameCodec::decode(pixels[frame], data, toc[frame].length, *this, previous);
+    delta_frames_decoded++;
+    temporal_frame.assign(pixels[frame], pixels[frame] + bytes_per_frame());
+    temporal_frame_index = frame;
+  }
+
+public:
+  virtual const FrameStats *frame_stats(unsigned frame) const {
+    assert(frame < nframes);
+    return frame_statistics.empty() ? NULL : &frame_statistics[frame];
+  }
+
+  virtual unsigned char *frame_rows(unsigned frame, unsigned row_begin, unsigned row_end) const {
+    assert(frame < nframes);
+    if (pixels[frame] || prefetched.count(frame) || !FrameCodec::decodes_bands(*this)) return frame_pixels(frame);
+    PartialFrame &p = partial_frame(frame);
+    last_use[frame] = ++use_clock; // protects p from FrameCache eviction during an instantiation
+    for (unsigned band = row_begin / p.band_height; band * p.band_height < row_end; band++) {
+      if (!p.decoded[band]) {
+        FrameCodec::decode_band(&p.pixels[0], band, p.data, toc[frame].length, *this);
+        p.decoded[band] = true;
+        bands_inflated++;
+      }
+    }
+    return &p.pixels[0];
+  }
+
+protected:
+  // Frames of band-compressed tilestacks of which only some bands have been decoded, by frame_rows.
+  // Kept separately from pixels, which holds only fully decoded frames, but charged to FrameCache too
+  struct PartialFrame {
+    std::vector<unsigned char> pixels;
+    std::vector<unsigned char> stored_frame; // unless held in place by reader
+    const unsigned char *data;
+    unsigned band_height;
+    std::vector<bool> decoded;
+    std::list<unsigned>::iterator lru;
+    FrameCache::iterator cache_entry;
+  };
+  mutable std::map<unsigned, PartialFrame> partial_frames;
+  mutable std::list<unsigned> partial_frames_lru;
+  mutable PartialFrame *last_partial_frame;
+  mutable unsigned last_partial_frame_index;
+
+  PartialFrame &partial_frame(unsigned frame) const {
+    // The last frame used is already at the front of partial_frames_lru
+    if (last_partial_frame && last_partial_frame_index == frame) return *last_partial_frame;
+    std::map<unsigned, PartialFrame>::iterator i = partial_frames.find(frame);
+    if (i != partial_frames.end()) {
+      partial_frames_lru.splice(partial_frames_lru.begin(), partial_frames_lru, i->second.lru);
+    } else {
+      while (partial_frames.size() >= max_partial_frames) delete_partial_frame(partial_frames_lru.back());
+      PartialFrame &p = partial_frames[frame];
+      partial_frames_lru.push_front(frame);
+      p.lru = partial_frames_lru.begin();
+      bool in_place;
+      std::vector<unsigned char> readahead_scratch;
+      p.data = resident_frame_data(frame, in_place, readahead_scratch);
+      if (!in_place) {
+        p.stored_frame.assign(p.data, p.data + toc[frame].length);
+        p.data = &p.stored_frame[0];
+      }
+      p.band_height = FrameCodec::band_height(p.data, toc[frame].length);
+      p.decoded.resize((tile_height + p.band_height - 1) / p.band_height);
+      p.pixels.resize(bytes_per_frame());
+      p.cache_entry = FrameCache::insert(this, frame, p.pixels.size() + p.stored_frame.size(), true);
+      compressed_tiles_read++;
+      partial_tiles_read++;
+      bands_in_partial_tiles += p.decoded.size();
+      i = partial_frames.find(frame);
+    }
+    last_partial_frame = &i->second;
+    last_partial_frame_index = frame;
+    return i->second;
+  }
+
+  // Move frame's partial decode, if any, into dest, and drop it from partial_frames and FrameCache
+  bool take_partial_frame(unsigned frame, PartialFrame &dest) const {
+    std::map<unsigned, PartialFrame>::iterator i = partial_frames.find(frame);
+    if (i == partial_frames.end()) return false;
+    // Moving stored_frame keeps its buffer, so data stays valid
+    dest = std::move(i->second);
+    delete_partial_frame(frame);
+    return true;
+  }
+
+  void delete_partial_frame(unsigned frame) const {
+    std::map<unsigned, PartialFrame>::iterator i = partial_frames.find(frame);
+    FrameCache::erase(i->second.cache_entry);
+    partial_frames_lru.erase(i->second.lru);
+    partial_frames.erase(i);
+    if (last_partial_frame_index == frame) last_partial_frame = NULL;
+  }
+
+  virtual void evict_partial(unsigned frame) const {
+    delete_partial_frame(frame);
+  }
+
+  void read_extension(size_t end, unsigned long long length) {
+    size_t stats_size = 4 + 24 * bands_per_pixel;
+    if (length > end || length != EXTENSION_HEADER_SIZE + stats_size * nframes) return;
+    std::vector<unsigned char> extension = reader->read(end - length, length);
+    if (read_u32(&extension[0]) != nframes || read_u32(&extension[4]) != bands_per_pixel) return;
+    frame_statistics.resize(nframes);
+    for (unsigned i = 0; i < nframes; i++) {
+      const unsigned char *frame_stats = &extension[EXTENSION_HEADER_SIZE + stats_size * i];
+      frame_statistics[i].all_zero = read_u32((unsigned char*) frame_stats) & EXTENSION_FRAME_ALL_ZERO;
+      for (unsigned band = 0; band < bands_per_pixel; band++) {
+        frame_statistics[i].min.push_back(read_double_64((unsigned char*) frame_stats + 4 + 24 * band +  0));
+        frame_statistics[i].max.push_back(read_double_64((unsigned char*) frame_stats + 4 + 24 * band +  8));
+        frame_statistics[i].mean.push_back(read_double_64((unsigned char*) frame_stats + 4 + 24 * band + 16));
+      }
     }
   }
 
@@ -159,11 +674,27 @@ protected:
 
     size_t tocentry_size = 24;
     size_t toclen = tocentry_size * nframes;
-    std::vector<unsigned char> tocdata = reader->read(filelen - footer_size - toclen, toclen);
+    if (filelen < footer_size + toclen) {
+      throw_error("Tilestack too short for %d frames", nframes);
+    }
+    size_t toc_address = filelen - footer_size - toclen;
+    // Read the extension trailer, if any, along with the TOC
+    size_t trailer_len = toc_address >= EXTENSION_TRAILER_SIZE ? EXTENSION_TRAILER_SIZE : 0;
+    std::vector<unsigned char> tocdata = reader->read(toc_address - trailer_len, trailer_len + toclen);
     for (unsigned i = 0; i < nframes; i++) {
-      toc[i].timestamp = read_double_64(&tocdata[i*tocentry_size +  0]);
-      toc[i].address =   read_u64      (&tocdata[i*tocentry_size +  8]);
-      toc[i].length =    read_u64      (&tocdata[i*tocentry_size + 16]);
+      toc[i].timestamp = read_double_64(&tocdata[trailer_len + i*tocentry_size +  0]);
+      toc[i].address =   read_u64      (&tocdata[trailer_len + i*tocentry_size +  8]);
+      toc[i].length =    read_u64      (&tocdata[trailer_len + i*tocentry_size + 16]);
+    }
+    if (trailer_len && read_u64(&tocdata[8]) == EXTENSION_MAGIC) {
+      read_extension(toc_address - trailer_len, read_u64(&tocdata[0]));
+    }
+
+    std::map<unsigned long long, std::vector<unsigned> > frames_by_address;
+    for (unsigned i = 0; i < nframes; i++) frames_by_address[toc[i].address].push_back(i);
+    for (std::map<unsigned long long, std::vector<unsigned> >::iterator i = frames_by_address.begin();
+         i != frames_by_address.end(); ++i) {
+      if (i->second.size() > 1) shared_frames[i->first].swap(i->second);
     }
   }
 };
@@ -171,13 +702,27 @@ protected:
 int TilestackReader::stacks_read;
 int TilestackReader::compressed_tiles_read;
 int TilestackReader::uncompressed_tiles_read;
+int TilestackReader::zero_copy_tiles_read;
+int TilestackReader::frame_reads;
+int TilestackReader::coalesced_tiles_read;
+int TilestackReader::partial_tiles_read;
+int TilestackReader::bands_in_partial_tiles;
+int TilestackReader::bands_inflated;
+int TilestackReader::delta_tiles_read;
+int TilestackReader::delta_frames_decoded;
+int TilestackReader::shared_tiles_copied;
+int TilestackReader::prefetched_tiles_read;
+std::atomic<int> TilestackReader::shared_cache_tiles_read;
+std::atomic<size_t> TilestackReader::prefetched_bytes;
+size_t TilestackReader::prefetch_budget = 64 * 1024 * 1024;
+size_t TilestackReader::coalesce_window = 4 * 1024 * 1024;
 
 AutoPtrStack<Tilestack> tilestackstack;
 
 void load(std::string filename)
 {
   simple_shared_ptr<Reader> reader(FileReader::open(filename));
-  simple_shared_ptr<Tilestack> tilestack(new TilestackReader(reader));
+  simple_shared_ptr<Tilestack> tilestack(new TilestackReader(reader, filename));
   tilestackstack.push(tilestack);
 }
 
@@ -212,15 +757,35 @@ class VizBand {
   double scale_over_maxval;
 
 public:
-  VizBand(JSON params, unsigned int band) {
+  VizBand(JSON params, unsigned int band, const Tilestack &src) {
     double gamma = get_param(params, "gamma", band, 1);
     one_over_gamma = 1.0 / gamma;
     double scale = get_param(params, "gain", band, 1);
-    // To get full and correct dynamic range, maxval should be 256 for 8-bit values (not 255)
-    maxval = get_param(params, "maxval", band, 256);
+    if (is_auto(params, "maxval", band)) {
+      maxval = max_band_value(src, band);
+    } else {
+      // To get full and correct dynamic range, maxval should be 256 for 8-bit values (not 255)
+      maxval = get_param(params, "maxval", band, 256);
+    }
     scale_over_maxval = scale / maxval;
   }
 
+  bool is_auto(JSON params, const char *name, unsigned int band) {
+    if (!params.hasKey(name)) return false;
+    JSON param = params[name].isArray() ? params[name][band] : params[name];
+    return param.isStr() && param.str() == "auto";
+  }
+
+  // Largest value of band across all frames, from stored frame statistics where available
+  static double max_band_value(const Tilestack &src, unsigned int band) {
+    double max = 0;
+    for (unsigned frame = 0; frame < src.nframes; frame++) {
+      const FrameStats *stats = src.frame_stats(frame);
+      max = std::max(max, stats ? stats->max[band] : FrameStats::compute(src.frame_pixels(frame), src).max[band]);
+    }
+    return max > 0 ? max : 1;
+  }
+
   double get_param(JSON params, const char *name, unsigned int band, double default_val) {
     if (!params.hasKey(name)) {
       return default_val;
@@ -247,7 +812,7 @@ public:
 
     (*(TilestackInfo*)this) = (*(TilestackInfo*)this->src.get());
     for (unsigned i = 0; i < bands_per_pixel; i++) {
-      viz_bands.push_back(VizBand(params, i));
+      viz_bands.push_back(VizBand(params, i, *this->src));
     }
     set_nframes(this->src->nframes);
   }
@@ -572,10 +1137,24 @@ public:
     set_nframes(base->nframes);
   }
 
+  virtual bool frame_known_empty(unsigned frame) const {
+    return base->frame_known_empty(frame) && overlay->frame_known_empty(frame);
+  }
+
   virtual void instantiate_pixels(unsigned frame) const {
     assert(!pixels[frame]);
     create(frame);
 
+    if (overlay->frame_known_empty(frame)) {
+      // Overlay is fully transparent
+      if (base->frame_known_empty(frame)) {
+        memset(pixels[frame], 0, bytes_per_frame());
+      } else {
+        memcpy(pixels[frame], base->frame_pixels(frame), bytes_per_frame());
+      }
+      return;
+    }
+
     unsigned char *base_pixel = base->frame_pixels(frame);
     unsigned char *overlay_pixel = overlay->frame_pixels(frame);
     unsigned char *composite_pixel = pixels[frame];
@@ -761,9 +1340,63 @@ void write_html(std::string dest)
   fprintf(stderr, "Created %s\n", html_filename.c_str());
 }
 
-void save(std::string dest)
+TilestackWriteOptions parse_write_options(JSON params)
 {
-  simple_shared_ptr<Tilestack> src(tilestackstack.pop());
+  TilestackWriteOptions options;
+  std::string compression = params.get("compression", std::string("zlib"));
+  if (compression == "none") {
+    options.compression_format = TilestackInfo::NO_COMPRESSION;
+  } else if (compression == "zlib") {
+    options.compression_format = TilestackInfo::ZLIB_COMPRESSION;
+  } else if (compression == "zlib-filtered") {
+    options.compression_format = TilestackInfo::ZLIB_FILTERED_COMPRESSION;
+  } else if (compression == "zlib-delta") {
+    options.compression_format = TilestackInfo::ZLIB_DELTA_COMPRESSION;
+    int keyframe_interval = params.get("keyframe_interval", (int) options.keyframe_interval);
+    if (keyframe_interval < 1) usage("--save: keyframe_interval must be at least 1");
+    options.keyframe_interval = keyframe_interval;
+  } else if (compression == "jpeg") {
+    options.compression_format = TilestackInfo::JPEG_COMPRESSION;
+    options.jpeg_quality = params.get("quality", options.jpeg_quality);
+    if (options.jpeg_quality < 0 || options.jpeg_quality > 100) usage("--save: quality must be between 0 and 100");
+  } else if (compression == "zlib-banded") {
+    options.compression_format = TilestackInfo::ZLIB_BANDED_COMPRESSION;
+    int band_height = params.get("band_height", (int) options.band_height);
+    if (band_height < 1) usage("--save: band_height must be at least 1");
+    options.band_height = band_height;
+  } else {
+    usage("--save: unknown compression '%s'", compression.c_str());
+  }
+  if (params.get("shuffle", false)) {
+    if (options.compression_format != TilestackInfo::ZLIB_COMPRESSION &&
+        options.compression_format != TilestackInfo::ZLIB_DELTA_COMPRESSION) {
+      usage("--save: shuffle requires zlib or zlib-delta compression");
+    }
+    options.compression_format |= TilestackInfo::SHUFFLE_FLAG;
+  }
+  options.frame_stats = params.get("frame_stats", true);
+  return options;
+}
+
+// Write src to dest, or with --pack-levels to the pack of dest's level
+void write_tilestack(const Tilestack &src, std::string dest, const TilestackWriteOptions &options)
+{
+  if (pack_levels) {
+    std::string stackset;
+    GPTileIdx tile = GPTileIdx::from_path(dest, ".ts2", stackset);
+    std::string pack = LevelPack::path(stackset, tile.level);
+    if (create_parent_directories) make_directory_and_parents(stackset);
+    // Compute and compress before taking the pack's lock, so parallel saves into one level only
+    // serialize on the append itself
+    MemoryWriter stack;
+    src.write(&stack, options);
+    LevelPackWriter out(pack, GPTileIdx::idx(tile.level, tile.x, tile.y));
+    if (!stack.data.empty()) out.write(&stack.data[0], stack.data.size());
+    out.close();
+    if (FileAdvice::drop_written) FileAdvice::drop_written_file(pack);
+    fprintf(stderr, "Added %s to %s\n", tile.path().c_str(), pack.c_str());
+    return;
+  }
 
   if (create_parent_directories) make_directory_and_parents(filename_directory(dest));
 
@@ -771,14 +1404,23 @@ void save(std::string dest)
 
   {
     simple_shared_ptr<FileWriter> out(FileWriter::open(temp_dest));
-    src->write(out.get());
+    src.write(out.get(), options);
+    // Everything must be written before the rename makes the file visible
+    out->close();
   }
 
   rename_file(temp_dest, dest);
+  if (FileAdvice::drop_written) FileAdvice::drop_written_file(dest);
 
   fprintf(stderr, "Created %s\n", dest.c_str());
 }
 
+void save(std::string dest, const TilestackWriteOptions &options)
+{
+  simple_shared_ptr<Tilestack> src(tilestackstack.pop());
+  write_tilestack(*src, dest, options);
+}
+
 class PrependLeaderTilestack : public LRUTilestack {
   simple_shared_ptr<Tilestack> source;
   unsigned leader_nframes;
@@ -887,6 +1529,11 @@ void write_video(std::string dest, double fps, double compression, int max_size,
     }
 
     for (unsigned frame = 0; frame < src->nframes; frame++) {
+      if (src->frame_known_empty(frame)) {
+        std::fill(destframe.begin(), destframe.end(), 0);
+        encoder->write_pixels(&destframe[0], destframe.size());
+        continue;
+      }
       unsigned char *srcptr = src->frame_pixels(frame);
       int src_bytes_per_pixel = src->bytes_per_pixel();
       unsigned char *destptr = &destframe[0];
@@ -925,18 +1572,184 @@ int compute_tile_nlevels(int width, int height, int tile_width, int tile_height)
   return max_level + 1;
 }
 
+namespace {
+  // Average of the 2x2 block of samples at src0[i], src0[i+n], src1[i], src1[i+n] for each band,
+  // counting only the samples present (src1 NULL for the last row of an odd-height image, pair_cols 1
+  // for the last column of an odd-width one)
+  template <typename T>
+  void reduce_2x2(T *dest, const T *src0, const T *src1, unsigned dest_width, unsigned src_width, unsigned bands) {
+    for (unsigned x = 0; x < dest_width; x++) {
+      unsigned pair_cols = (2 * x + 1 < src_width) ? 2 : 1;
+      unsigned count = pair_cols * (src1 ? 2 : 1);
+      for (unsigned b = 0; b < bands; b++) {
+        unsigned long sum = 0;
+        for (unsigned c = 0; c < pair_cols; c++) {
+          sum += src0[(2 * x + c) * bands + b];
+          if (src1) sum += src1[(2 * x + c) * bands + b];
+        }
+        dest[x * bands + b] = (sum + count / 2) / count;
+      }
+    }
+  }
+}
+
+// Tiles one pyramid level of an image, receiving its rows a stripe of up to tilesize rows at a time.
+// With a coarser level, each pair of rows is also reduced 2x2 into a row of that level, so that all
+// levels need only one rolling stripe each rather than the whole image.  With a pool, the tiles of
+// a full stripe are cut and written by the pool while the next stripe is filled
+class LevelTiler {
+  std::string dest, format;
+  int level;
+  unsigned width, height, bands_per_pixel, bits_per_band;
+  std::vector<unsigned char> stripe, pending;
+  std::vector<unsigned char> writing;           // previous stripe, while its tiles are written
+  std::vector<std::future<void> > tile_writes; // of writing
+  unsigned stripe_top, filled; // first image row of the stripe, and rows of it filled
+  bool have_pending;
+  ThreadPool *pool;
+  simple_shared_ptr<LevelTiler> coarser;
+  static std::set<std::string> directories_made;
+
+  unsigned bytes_per_pixel() const { return bands_per_pixel * bits_per_band / 8; }
+  unsigned bytes_per_row() const { return bytes_per_pixel() * width; }
+
+  void reduce(const unsigned char *row0, const unsigned char *row1) {
+    unsigned char *dest = coarser->row(coarser->filled);
+    if (bits_per_band == 16) {
+      reduce_2x2((unsigned short*) dest, (const unsigned short*) row0, (const unsigned short*) row1,
+                 coarser->width, width, bands_per_pixel);
+    } else {
+      reduce_2x2(dest, row0, row1, coarser->width, width, bands_per_pixel);
+    }
+    coarser->add_rows(1);
+  }
+
+  static void write_tile(const unsigned char *stripe, unsigned left, unsigned ncols, unsigned bytes_per_row,
+                         unsigned bands_per_pixel, unsigned bits_per_band,
+                         const std::string &temp_path, const std::string &path) {
+    unsigned bytes_per_pixel = bands_per_pixel * bits_per_band / 8;
+    std::vector<unsigned char> tile(bytes_per_pixel * tilesize * tilesize);
+    for (unsigned y = 0; y < tilesize; y++) {
+      memcpy(&tile[y * bytes_per_pixel * tilesize], &stripe[y * bytes_per_row + left * bytes_per_pixel],
+             ncols * bytes_per_pixel);
+    }
+    ImageWriter::write(temp_path, tilesize, tilesize, bands_per_pixel, bits_per_band, &tile[0]);
+    rename_file(temp_path, path);
+  }
+
+  void write_tiles() {
+    // Pad to whole tiles with zeros
+    std::fill(stripe.begin() + filled * bytes_per_row(), stripe.end(), 0);
+    finish_writes();
+    writing.swap(stripe);
+    if (stripe.empty()) stripe.resize(writing.size());
+    for (unsigned left = 0; left < width; left += tilesize) {
+      unsigned ncols = std::min(width - left, tilesize);
+      // Paths and directories here, as neither temporary_path nor directories_made is thread-safe
+      std::string path = dest + "/" + GPTileIdx(level, left/tilesize, stripe_top/tilesize).path() + "." + format;
+      std::string directory = filename_directory(path);
+      if (!directories_made.count(directory)) {
+        make_directory_and_parents(directory);
+        directories_made.insert(directory);
+      }
+      std::string temp_path = temporary_path(path);
+      const unsigned char *src = &writing[0];
+      unsigned src_bytes_per_row = bytes_per_row(), bands = bands_per_pixel, bits = bits_per_band;
+      if (pool) {
+        tile_writes.push_back(pool->submit([=] {
+          write_tile(src, left, ncols, src_bytes_per_row, bands, bits, temp_path, path);
+        }));
+      } else {
+        write_tile(src, left, ncols, src_bytes_per_row, bands, bits, temp_path, path);
+      }
+    }
+  }
+
+public:
+  // Tiles levels down to min_level if below level
+  LevelTiler(const std::string &dest, const std::string &format, int level, int min_level,
+             unsigned width, unsigned height, unsigned bands_per_pixel, unsigned bits_per_band, ThreadPool *pool) :
+    dest(dest), format(format), level(level), width(width), height(height),
+    bands_per_pixel(bands_per_pixel), bits_per_band(bits_per_band), stripe_top(0), filled(0), have_pending(false),
+    pool(pool) {
+    stripe.resize(bytes_per_row() * tilesize);
+    if (level > min_level) {
+      if (bits_per_band != 8 && bits_per_band != 16) {
+        throw_error("image2tiles: can't reduce %d-bit images to coarser levels;  only 8 and 16 bits are supported",
+                    bits_per_band);
+      }
+      pending.resize(bytes_per_row());
+      coarser.reset(new LevelTiler(dest, format, level - 1, min_level, (width + 1) / 2, (height + 1) / 2,
+                                   bands_per_pixel, bits_per_band, pool));
+    }
+  }
+
+  ~LevelTiler() {
+    // Tasks may still refer to writing;  errors were already reported by finish_writes, if called
+    for (unsigned i = 0; i < tile_writes.size(); i++) {
+      if (tile_writes[i].valid()) tile_writes[i].wait();
+    }
+  }
+
+  // Wait for the tiles of this and coarser levels to be written, rethrowing any error
+  void finish_writes() {
+    for (unsigned i = 0; i < tile_writes.size(); i++) tile_writes[i].get();
+    tile_writes.clear();
+    if (coarser.get()) coarser->finish_writes();
+  }
+
+  unsigned stripe_rows() const { return std::min(height - stripe_top, tilesize); }
+  // Start tiling at image row top, a multiple of tilesize, instead of 0.  Only without coarser levels,
+  // which would need the rows above
+  void start_at(unsigned top) {
+    assert(!coarser.get() && !filled && top % tilesize == 0);
+    stripe_top = top;
+  }
+  unsigned char *row(unsigned i) { return &stripe[i * bytes_per_row()]; }
+
+  // Rows [filled, filled + nrows) of the stripe have been written
+  void add_rows(unsigned nrows) {
+    if (coarser.get()) {
+      for (unsigned i = filled; i < filled + nrows; i++) {
+        bool last_row = (stripe_top + i == height - 1);
+        if (have_pending) {
+          reduce(&pending[0], row(i));
+          have_pending = false;
+        } else if (last_row) {
+          reduce(row(i), NULL);
+        } else {
+          memcpy(&pending[0], row(i), bytes_per_row());
+          have_pending = true;
+        }
+      }
+    }
+    filled += nrows;
+    if (filled == stripe_rows()) {
+      write_tiles();
+      stripe_top += filled;
+      filled = 0;
+    }
+  }
+};
+
+std::set<std::string> LevelTiler::directories_made;
+
+bool image2tiles_all_levels = false;
+unsigned int image_scale = 1;
+// Tile rows [image2tiles_first_tile_row, image2tiles_end_tile_row) only, if set
+bool image2tiles_tile_rows = false;
+unsigned int image2tiles_first_tile_row, image2tiles_end_tile_row;
+
 void image2tiles(std::string dest, std::string format, std::string src)
 {
-  if (filename_exists(dest)) {
+  // Workers tiling other rows of the same image may have created dest already
+  if (filename_exists(dest) && !image2tiles_tile_rows) {
     fprintf(stderr, "%s already exists, skipping\n", dest.c_str());
     return;
   }
-  simple_shared_ptr<ImageReader> reader(ImageReader::open(src));
+  simple_shared_ptr<ImageReader> reader(ImageReader::open(src, image_scale));
   //fprintf(stderr, "Opened %s: %d x %d pixels\n", src.c_str(), reader->width(), reader->height());
 
-  std::vector<unsigned char> stripe(reader->bytes_per_row() * tilesize);
-  std::vector<unsigned char> tile(reader->bytes_per_pixel() * tilesize * tilesize);
-
   int max_level = compute_tile_nlevels(reader->width(), reader->height(), tilesize, tilesize);
 
   make_directory_and_parents(dest);
@@ -946,35 +1759,39 @@ void image2tiles(std::string dest, std::string format, std::string src)
     r["width"] = reader->width();
     r["height"] = reader->height();
     r["tile_width"] = r["tile_height"] = tilesize;
+    // Every worker of a split image writes the same r.json;  rename so that none is seen half-written
     std::string jsonfile = dest + "/r.json";
-    std::ofstream jsonout(jsonfile.c_str());
-    if (!jsonout.good()) throw_error("Error opening %s for writing", jsonfile.c_str());
-    jsonout << r;
+    std::string temp_jsonfile = temporary_path(jsonfile);
+    {
+      std::ofstream jsonout(temp_jsonfile.c_str());
+      if (!jsonout.good()) throw_error("Error opening %s for writing", temp_jsonfile.c_str());
+      jsonout << r;
+    }
+    rename_file(temp_jsonfile, jsonfile);
   }
 
-  for (unsigned top = 0; top < reader->height(); top += tilesize) {
-    unsigned nrows = std::min(reader->height() - top, tilesize);
-    fill(stripe.begin(), stripe.end(), 0);
-    reader->read_rows(&stripe[0], nrows);
-    for (unsigned left = 0; left < reader->width(); left += tilesize) {
-      unsigned ncols = std::min(reader->width() - left, tilesize);
-      fill(tile.begin(), tile.end(), 0);
-      for (unsigned y = 0; y < tilesize; y++) {
-        memcpy(&tile[y * reader->bytes_per_pixel() * tilesize],
-               &stripe[y * reader->bytes_per_row() + left * reader->bytes_per_pixel()],
-               ncols * reader->bytes_per_pixel());
-      }
-
-      std::string path = dest + "/" + GPTileIdx(max_level - 1, left/tilesize, top/tilesize).path() + "." + format;
-      std::string directory = filename_directory(path);
-      make_directory_and_parents(directory);
-      std::string temp_path = temporary_path(path);
-      ImageWriter::write(temp_path, tilesize, tilesize, reader->bands_per_pixel(), reader->bits_per_band(),
-                         &tile[0]);
+  unsigned begin = 0, end = reader->height();
+  if (image2tiles_tile_rows) {
+    begin = std::min((unsigned long long) image2tiles_first_tile_row * tilesize, (unsigned long long) reader->height());
+    end = std::min((unsigned long long) image2tiles_end_tile_row * tilesize, (unsigned long long) reader->height());
+  }
 
-      rename_file(temp_path, path);
-    }
+  // Tiles of each stripe are written by the pool while the next stripe is decoded
+  unsigned nthreads = ThreadPool::default_size();
+  simple_shared_ptr<ThreadPool> pool(nthreads > 1 ? new ThreadPool(nthreads) : NULL);
+  LevelTiler base(dest, format, max_level - 1, image2tiles_all_levels ? 0 : max_level - 1,
+                  reader->width(), reader->height(), reader->bands_per_pixel(), reader->bits_per_band(), pool.get());
+  // A range past the bottom of the image leaves this worker nothing to do
+  if (begin && begin < end) {
+    reader->skip_rows(begin);
+    base.start_at(begin);
+  }
+  for (unsigned top = begin; top < end; top += tilesize) {
+    unsigned nrows = base.stripe_rows();
+    reader->read_rows(base.row(0), nrows);
+    base.add_rows(nrows);
   }
+  base.finish_writes();
 }
 
 class TilestackFromTiles : public LRUTilestack {
@@ -1002,6 +1819,7 @@ private:
 
     toc[frame].timestamp = 0;
     simple_shared_ptr<ImageReader> tile(ImageReader::open(srcs[frame]));
+    tile->drop_on_close = delete_source_tiles;
     assert(tile->width() == tile_width);
     assert(tile->height() == tile_height);
     assert(tile->bands_per_pixel() == bands_per_pixel);
@@ -1017,6 +1835,129 @@ void load_tiles(const std::vector<std::string> &srcs)
   tilestackstack.push(tilestack);
 }
 
+// One tile column of a stripe of rows decoded from each frame's source image, as a tilestack.
+// Pixels past the right or bottom edge of the image are zero, as in tiles from --image2tiles
+class TilestackFromStripes : public LRUTilestack {
+  const std::vector<std::vector<unsigned char> > &stripes;
+  unsigned stripe_bytes_per_row, left, ncols, nrows;
+public:
+  TilestackFromStripes(const std::vector<std::vector<unsigned char> > &stripes, const ImageReader &image,
+                       unsigned left, unsigned ncols, unsigned nrows) :
+    stripes(stripes), stripe_bytes_per_row(image.bytes_per_row()), left(left), ncols(ncols), nrows(nrows) {
+    set_nframes(stripes.size());
+    tile_width = tile_height = tilesize;
+    bands_per_pixel = image.bands_per_pixel();
+    bits_per_band = image.bits_per_band();
+    pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
+    compression_format = TilestackInfo::NO_COMPRESSION;
+  }
+private:
+  virtual void instantiate_pixels(unsigned frame) const {
+    assert(!pixels[frame]);
+    create(frame);
+    toc[frame].timestamp = 0;
+    memset(pixels[frame], 0, bytes_per_frame());
+    for (unsigned y = 0; y < nrows; y++) {
+      memcpy(pixels[frame] + y * tile_width * bytes_per_pixel(),
+             &stripes[frame][y * stripe_bytes_per_row + left * bytes_per_pixel()],
+             ncols * bytes_per_pixel());
+    }
+  }
+};
+
+// How many source images images2stacks keeps open at once:  half the descriptor limit, leaving the
+// rest for tilestacks, packs and the like
+unsigned max_open_images() {
+#ifndef _WIN32
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    return std::max(16, (int) (limit.rlim_cur / 2));
+  }
+#endif
+  return 256;
+}
+
+// Transpose source images (one per frame) straight into the base-level tilestacks of stackset
+// dest, without tiling each image to files first.  Reads one stripe of tilesize rows from every
+// image at a time, so memory is bounded by frames x tilesize rows.  Up to max_open_images() images
+// stay open throughout;  the rest are reopened for each stripe, skipping the rows above it
+void images2stacks(std::string dest, const std::vector<std::string> &srcs, const TilestackWriteOptions &options)
+{
+  unsigned nopen = std::min((unsigned) srcs.size(), max_open_images());
+  std::vector<simple_shared_ptr<ImageReader> > readers(srcs.size());
+  for (unsigned i = 0; i < srcs.size(); i++) {
+    readers[i].reset(ImageReader::open(srcs[i], image_scale));
+    const ImageReader &first = *readers[0], &reader = *readers[i];
+    if (reader.width() != first.width() || reader.height() != first.height() ||
+        reader.bands_per_pixel() != first.bands_per_pixel() || reader.bits_per_band() != first.bits_per_band()) {
+      throw_error("%s is %dx%d with %d %d-bit bands, but %s is %dx%d with %d %d-bit bands",
+                  srcs[i].c_str(), reader.width(), reader.height(), reader.bands_per_pixel(), reader.bits_per_band(),
+                  srcs[0].c_str(), first.width(), first.height(), first.bands_per_pixel(), first.bits_per_band());
+    }
+    if (i >= nopen) readers[i].reset(NULL);
+  }
+  const ImageReader &image = *readers[0];
+  int max_level = compute_tile_nlevels(image.width(), image.height(), tilesize, tilesize);
+  if (nopen < srcs.size()) {
+    fprintf(stderr, "images2stacks: keeping %d of %d images open;  reopening the rest for each stripe\n",
+            nopen, (int) srcs.size());
+  }
+
+  make_directory_and_parents(dest);
+  {
+    Json::Value r;
+    r["width"] = image.width();
+    r["height"] = image.height();
+    r["tile_width"] = r["tile_height"] = tilesize;
+    std::string jsonfile = dest + "/r.json";
+    std::string temp_jsonfile = temporary_path(jsonfile);
+    {
+      std::ofstream jsonout(temp_jsonfile.c_str());
+      if (!jsonout.good()) throw_error("Error opening %s for writing", temp_jsonfile.c_str());
+      jsonout << r;
+    }
+    rename_file(temp_jsonfile, jsonfile);
+  }
+
+  std::vector<std::vector<unsigned char> > stripes(srcs.size());
+  unsigned nthreads = std::min(ThreadPool::default_size(), (unsigned) srcs.size());
+  simple_shared_ptr<ThreadPool> pool(nthreads > 1 ? new ThreadPool(nthreads) : NULL);
+  for (unsigned top = 0; top < image.height(); top += tilesize) {
+    unsigned nrows = std::min(image.height() - top, tilesize);
+    // Decode the stripe of every frame, in parallel
+    std::vector<std::future<void> > decoded;
+    for (unsigned i = 0; i < srcs.size(); i++) {
+      stripes[i].resize(image.bytes_per_row() * nrows);
+      ImageReader *reader = readers[i].get();
+      unsigned char *stripe = &stripes[i][0];
+      std::string src = srcs[i];
+      auto read_stripe = [reader, src, stripe, top, nrows] {
+        if (reader) {
+          reader->read_rows(stripe, nrows);
+        } else {
+          simple_shared_ptr<ImageReader> reopened(ImageReader::open(src, image_scale));
+          if (top) reopened->skip_rows(top);
+          reopened->read_rows(stripe, nrows);
+        }
+      };
+      if (pool.get()) {
+        decoded.push_back(pool->submit(read_stripe));
+      } else {
+        read_stripe();
+      }
+    }
+    for (unsigned i = 0; i < decoded.size(); i++) decoded[i].get();
+
+    for (unsigned left = 0; left < image.width(); left += tilesize) {
+      unsigned ncols = std::min(image.width() - left, tilesize);
+      TilestackFromStripes tilestack(stripes, image, left, ncols, nrows);
+      std::string path = dest + "/" + GPTileIdx(max_level - 1, left/tilesize, top/tilesize).path() + ".ts2";
+      if (!pack_levels) make_directory_and_parents(filename_directory(path));
+      write_tilestack(tilestack, path, options);
+    }
+  }
+}
+
 struct Image {
   PixelInfo pixel_info;
   int width;
@@ -1037,6 +1978,7 @@ protected:
 
   static int fast_render_count;
   static int slow_render_count;
+  static int tiles_skipped_by_map;
 
   static double interpolate(double val, double in_min, double in_max, double out_min, double out_max) {
     return (val - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
@@ -1053,7 +1995,42 @@ protected:
 
   virtual Tilestack *get_tilestack(int level, int x, int y) = 0;
 
+  // Source rows last looked up, by parity of y so that interpolate_pixel's two rows don't displace each
+  // other.  Each render holds a FrameCache::Instantiation, which keeps the frames they point into
+  struct SourceRow {
+    bool valid;
+    int frame, level, tile_x, y;
+    const unsigned char *pixels; // start of the row within the tile;  NULL if the tile is missing or empty
+  };
+  SourceRow source_rows[2];
+
+  void forget_source_rows() {
+    source_rows[0].valid = source_rows[1].valid = false;
+  }
+
+  // Row y of tile column tile_x, from get_tilestack, frame_known_empty and frame_rows only on a miss
+  const unsigned char *source_row(int frame, int level, int tile_x, int y) {
+    SourceRow &r = source_rows[y & 1];
+    if (!r.valid || r.y != y || r.tile_x != tile_x || r.frame != frame || r.level != level) {
+      r.valid = true;
+      r.frame = frame;
+      r.level = level;
+      r.tile_x = tile_x;
+      r.y = y;
+      r.pixels = NULL;
+      Tilestack *tilestack = get_tilestack(level, tile_x, y / tile_height);
+      if (tilestack && !tilestack->frame_known_empty(frame)) {
+        int row = y % tile_height;
+        r.pixels = tilestack->frame_rows(frame, row, row + 1) + bytes_per_pixel() * row * tile_width;
+      }
+    }
+    return r.pixels;
+  }
+
 public:
+  Renderer() {
+    forget_source_rows();
+  }
 
   // 47 vs .182:  250x more CPU than ffmpeg
   // 1.86 vs .182: 10x more CPU than ffmpeg
@@ -1062,16 +2039,12 @@ public:
   // .41 vs .182: 2.25x more CPU than ffmpeg
 
   void get_pixel(unsigned char *dest, int frame, int level, int x, int y) {
-    if (x >= 0 && y >= 0) {
-      int tile_x = x / tile_width;
-      int tile_y = y / tile_height;
-      Tilestack *tilestack = get_tilestack(level, tile_x, tile_y);
-      if (tilestack) {
-        memcpy(dest, tilestack->frame_pixel(frame, x % tile_width, y % tile_height), bytes_per_pixel());
-        return;
-      }
+    const unsigned char *row = (x >= 0 && y >= 0) ? source_row(frame, level, x / tile_width, y) : NULL;
+    if (row) {
+      memcpy(dest, row + bytes_per_pixel() * (x % tile_width), bytes_per_pixel());
+    } else {
+      memset(dest, 0, bytes_per_pixel());
     }
-    memset(dest, 0, bytes_per_pixel());
   }
 
   // Pixels are centered at +.5
@@ -1116,6 +2089,8 @@ public:
                   frameno, nframes-1);
     }
     Bbox myb = frame.bounds;
+    FrameCache::Instantiation instantiation;
+    forget_source_rows();
 
     double x1, y1, theta1, psi1, x2, y2, z2, x3, y3, z3, psi2, theta2, x, y;
 
@@ -1215,6 +2190,9 @@ public:
 
     // scale between original pixels and desination frame.  If less than one, we subsample (sharp), or greater than
     // one means supersample (blurry)
+    FrameCache::Instantiation instantiation;
+    forget_source_rows();
+
     double scale = dest.width / frame.bounds.width;
     double cutoff = 1.0000001;
     if (downsize) cutoff *= .5;
@@ -1237,8 +2215,18 @@ public:
       int bounds_x = (int)bounds.x;
       int bounds_y = (int)bounds.y;
       for (int y = 0; y < dest.height; y++) {
-        for (int x = 0; x < dest.width; x++) {
-          get_pixel(dest.pixel(x, y), frameno, source_level, bounds_x + x, bounds_y + y);
+        int source_y = bounds_y + y;
+        // One copy per run of pixels from the same source tile
+        for (int x = 0, run; x < dest.width; x += run) {
+          int source_x = bounds_x + x;
+          run = std::min(dest.width - x, source_x < 0 ? -source_x : (int) (tile_width - source_x % tile_width));
+          const unsigned char *row = (source_x >= 0 && source_y >= 0) ?
+            source_row(frameno, source_level, source_x / tile_width, source_y) : NULL;
+          if (row) {
+            memcpy(dest.pixel(x, y), row + bytes_per_pixel() * (source_x % tile_width), bytes_per_pixel() * run);
+          } else {
+            memset(dest.pixel(x, y), 0, bytes_per_pixel() * run);
+          }
         }
       }
     } else {
@@ -1260,33 +2248,63 @@ public:
     int total_render_count = slow_render_count + fast_render_count;
     std::string ret = string_printf("%d images rendered", total_render_count);
     if (total_render_count) ret += string_printf(" (%.0f%% fast)", 100.0 * fast_render_count / total_render_count);
+    if (tiles_skipped_by_map) ret += string_printf(";  %d lookups of missing tiles answered by tile map", tiles_skipped_by_map);
     return ret;
   }
 };
 
 int Renderer::slow_render_count;
 int Renderer::fast_render_count;
+int Renderer::tiles_skipped_by_map;
 
 class StacksetRenderer : public Renderer {
 protected:
   std::string stackset_path;
   JSON info;
   std::map<unsigned long long, TilestackReader* > readers;
+  std::map<int, LevelPack*> packs; // NULL if the level isn't packed
+  simple_shared_ptr<TileMap> tile_map; // NULL if the stackset has none
 
   std::string path(int level, int x, int y) {
     return stackset_path + "/" + GPTileIdx(level, x, y).path() + ".ts2";
   }
 
+  LevelPack *get_pack(int level) {
+    if (packs.find(level) == packs.end()) {
+      std::string pack_path = LevelPack::path(stackset_path, level);
+      try {
+        packs[level] = new LevelPack(simple_shared_ptr<Reader>(FileReader::open(pack_path)), pack_path);
+      } catch (std::runtime_error &e) {
+        packs[level] = NULL;
+      }
+    }
+    return packs[level];
+  }
+
   TilestackReader *get_tilestack(int level, int x, int y) {
     static unsigned long long cached_idx = -1;
     static TilestackReader *cached_reader = NULL;
     unsigned long long idx = GPTileIdx::idx(level, x, y);
     if (idx == cached_idx) return cached_reader;
+    if (tile_map.get() && !tile_map->exists(level, x, y)) {
+      tiles_skipped_by_map++;
+      cached_idx = idx;
+      cached_reader = NULL;
+      return NULL;
+    }
     if (readers.find(idx) == readers.end()) {
       // TODO(RS): If this starts running out of RAM, consider LRU on the readers
       try {
-        //fprintf(stderr, "get_reader constructing TilestackReader %llx from %s\n", (unsigned long long) readers[idx], path(level, x, y).c_str());
-	readers[idx] = new TilestackReader(simple_shared_ptr<Reader>(FileReader::open(path(level, x, y))));
+        // Tilestacks in the level's pack, if any, take precedence over separate files
+        LevelPack *pack = get_pack(level);
+        LevelPack::Entry entry;
+        if (pack && pack->find(idx, entry)) {
+          readers[idx] = new TilestackReader(simple_shared_ptr<Reader>(pack->open(idx)),
+                                             LevelPack::path(stackset_path, level), entry.offset);
+        } else {
+          //fprintf(stderr, "get_reader constructing TilestackReader %llx from %s\n", (unsigned long long) readers[idx], path(level, x, y).c_str());
+          readers[idx] = new TilestackReader(simple_shared_ptr<Reader>(FileReader::open(path(level, x, y))), path(level, x, y));
+        }
       } catch (std::runtime_error &e) {
         //fprintf(stderr, "No tilestackreader for (%d, %d, %d)\n", level, x, y);
         readers[idx] = NULL;
@@ -1300,14 +2318,26 @@ protected:
 public:
   StacksetRenderer(const std::string &stackset_path) : stackset_path(stackset_path) {
     fprintf(stderr, "stackset_path is %s\n", stackset_path.c_str());
-    std::string json_path = stackset_path + "/r.json";
-    info = JSON::fromFile(json_path);
+    // Through FileReader, so that stacksets can be read from any storage backend, e.g. http://
+    simple_shared_ptr<Reader> json_reader(FileReader::open(stackset_path + "/r.json"));
+    std::vector<unsigned char> json = json_reader->read(0, json_reader->length());
+    info = JSON(std::string(json.begin(), json.end()));
     width = info["width"].integer();
     height = info["height"].integer();
     tile_width = info["tile_width"].integer();
     tile_height = info["tile_height"].integer();
 
     nlevels = compute_tile_nlevels(width, height, tile_width, tile_height);
+    try {
+      simple_shared_ptr<Reader> map_reader(FileReader::open(TileMap::path(stackset_path)));
+      tile_map.reset(new TileMap(map_reader->read(0, map_reader->length())));
+      if (!tile_map->same_grid(TileMap(nlevels, width, height, tile_width, tile_height))) {
+        fprintf(stderr, "Ignoring %s, made for a different pyramid\n", TileMap::path(stackset_path).c_str());
+        tile_map.reset(NULL);
+      }
+    } catch (std::runtime_error &e) {
+      // No map;  probe for each tile
+    }
     Tilestack *tilestack = get_tilestack(nlevels-1, 0, 0);
     if (!tilestack) throw_error("Initializing stackset but couldn't find tilestack at path %s",
                                 path(nlevels-1, 0, 0).c_str());
@@ -1319,9 +2349,56 @@ public:
       if (i->second) delete i->second;
       i->second = NULL;
     }
+    for (std::map<int, LevelPack*>::iterator i = packs.begin(); i != packs.end(); ++i) delete i->second;
   }
 };
 
+// Record which tilestacks of the stackset exist in its TileMap:  those listed in tile_list, a JSON file
+// {"tiles": [[level, x, y], ...]}, if given, or else those found, separate or packed
+void write_tile_map(const std::string &stackset_path, const std::string &tile_list) {
+  JSON info(read_file(stackset_path + "/r.json"));
+  int width = info["width"].integer(), height = info["height"].integer();
+  int tile_width = info["tile_width"].integer(), tile_height = info["tile_height"].integer();
+  TileMap map(compute_tile_nlevels(width, height, tile_width, tile_height), width, height, tile_width, tile_height);
+  size_t ntiles = 0;
+  if (!tile_list.empty()) {
+    JSON tiles = JSON::fromFile(tile_list)["tiles"];
+    for (unsigned i = 0; i < tiles.size(); i++) {
+      int level = tiles[i][0].integer(), x = tiles[i][1].integer(), y = tiles[i][2].integer();
+      if (level < 0 || level >= map.nlevels() || x < 0 || y < 0 || x >= (int) map.cols(level) || y >= (int) map.rows(level)) {
+        throw_error("--write-tile-map: tile (%d, %d, %d) in %s is outside the pyramid", level, x, y, tile_list.c_str());
+      }
+      map.set(level, x, y);
+    }
+  }
+  for (int level = 0; level < map.nlevels(); level++) {
+    ntiles += map.rows(level) * map.cols(level);
+    if (!tile_list.empty()) continue;
+    simple_shared_ptr<LevelPack> pack;
+    std::string pack_path = LevelPack::path(stackset_path, level);
+    if (filename_exists(pack_path)) pack.reset(new LevelPack(simple_shared_ptr<Reader>(FileReader::open(pack_path)), pack_path));
+    for (unsigned y = 0; y < map.rows(level); y++) {
+      for (unsigned x = 0; x < map.cols(level); x++) {
+        LevelPack::Entry entry;
+        if ((pack.get() && pack->find(GPTileIdx::idx(level, x, y), entry)) ||
+            filename_exists(stackset_path + "/" + GPTileIdx(level, x, y).path() + ".ts2")) {
+          map.set(level, x, y);
+        }
+      }
+    }
+  }
+  std::string dest = TileMap::path(stackset_path);
+  std::string temp_dest = temporary_path(dest);
+  {
+    std::vector<unsigned char> serialized = map.serialize();
+    simple_shared_ptr<FileWriter> out(FileWriter::open(temp_dest));
+    out->write(&serialized[0], serialized.size());
+    out->close();
+  }
+  rename_file(temp_dest, dest);
+  fprintf(stderr, "Created %s:  %d of %d tiles exist\n", dest.c_str(), (int) map.count(), (int) ntiles);
+}
+
 class TilestackRenderer : public Renderer {
 protected:
   simple_shared_ptr<Tilestack> tilestack;
@@ -1505,8 +2582,19 @@ void usage(const char *fmt, ...) {
   fprintf(stderr,          "\nUsage:\n"
           "tilestacktool [args]\n"
           "--load src.ts2\n"
-          "--save dest.ts2\n"
+          "--save dest.ts2 [options-json]\n"
+          "        options-json: {\"compression\": \"zlib\"}  (default)\n"
+          "           compression: none, zlib, zlib-filtered, zlib-delta, jpeg, or zlib-banded\n"
+          "           zlib-filtered applies PNG row predictors before zlib;  usually smaller for photographic tiles\n"
+          "           zlib-delta stores each frame as a residual from the previous frame, with a keyframe every\n"
+          "              keyframe_interval frames (default 16);  random access decodes from the nearest keyframe\n"
+          "           shuffle: true groups the bytes of 16-bit and wider samples into planes before zlib or zlib-delta\n"
+          "           jpeg is lossy, for 1 or 3 bands of 8 bits, with quality 0-100 (default 90)\n"
+          "           zlib-banded compresses horizontal bands of band_height rows (default 32) independently, so that\n"
+          "              rendering from a few rows of a tile only decompresses the bands it touches\n"
+          "           frame_stats: false omits the block of per-frame statistics (for jpeg, taken from decoded frames)\n"
           "--viz min max gamma\n"
+          "        maxval \"auto\" uses the largest value in the stack, from stored frame statistics when available\n"
           "--writehtml dest.html\n"
           "--writevideo dest.type fps compression codec\n"
           "              h.264: 24=high quality, 28=typical, 30=low quality\n"
@@ -1515,11 +2603,32 @@ void usage(const char *fmt, ...) {
           "--ffmpeg-path path_to_ffmpeg\n"
           "--image2tiles dest_dir format src_image\n"
           "              Be sure to set tilesize earlier in the commandline\n"
+          "--image-scale N\n"
+          "        Following --image2tiles and --images2stacks commands decode source images at 1/N size (N = 2, 4, or\n"
+          "        8;  JPEG only), in the DCT domain, at a fraction of the cost of full decoding.  For previews:  the\n"
+          "        tiles are those of the full-resolution pyramid's levels log2(N) coarser, at the same paths\n"
+          "--image2tiles-tile-rows first end\n"
+          "        Following --image2tiles commands only write the base-level tiles of tile rows [first, end), skipping\n"
+          "        the image rows above without fully decoding them, so that workers can split one huge image by rows.\n"
+          "        Tiles are named as in a whole-image run, and each worker writes the same r.json\n"
+          "--image2tiles-all-levels\n"
+          "        Following --image2tiles commands also write every coarser level of the pyramid, down to the single\n"
+          "        tile r, reducing each stripe 2x2 in memory as the image is decoded\n"
           "--tilesize N\n"
           "--loadtiles src_image0 src_image1 ... src_imageN\n"
           "--loadtiles-from-json path.json\n"
+          "--images2stacks dest_dir [options-json] src_image0 src_image1 ... src_imageN\n"
+          "--images2stacks dest_dir [options-json] @path.json   (path.json is {\"images\": [src_image0, ...]})\n"
+          "        Create the base-level tilestacks of stackset dest_dir directly from source images, one per frame,\n"
+          "        reading a stripe of tilesize rows from each at a time.  Replaces --image2tiles of each image followed\n"
+          "        by --loadtiles and --save of each tile.  options-json is as for --save.  Set tilesize earlier\n"
           "--delete-source-tiles\n"
+          "        Delete tiles loaded afterwards by --loadtiles at exit, and drop them from the page cache once read\n"
           "--create-parent-directories\n"
+          "--pack-levels\n"
+          "        Following --save commands to a stackset tile (stackset/r01/r012.ts2) instead append the tilestack\n"
+          "        to the pack of its level (stackset/level-3.tspack), replacing any earlier copy.  Parallel jobs may\n"
+          "        append to the same pack.  Rendering from a stackset reads packed tilestacks before separate files\n"
           "--path2stack width height path-or-warp-json stackset-path [warp-settings-json]\n"
           "        width, height:  size, in pixels, of output stack\n"
           "        path-or-warp-json:\n"
@@ -1556,6 +2665,42 @@ void usage(const char *fmt, ...) {
           "--composite\n"
           "        Framewise overlay top of stack onto second from top.  Stacks must have same dimensions\n"
           "--createfile file   (like touch file)\n"
+          "--write-tile-map stackset-path [tiles.json]\n"
+          "        Record which tilestacks of the stackset exist in stackset-path/r.tilemap, so that rendering skips\n"
+          "        missing tiles without trying to open them.  With tiles.json ({\"tiles\": [[level, x, y], ...]}),\n"
+          "        record the tiles listed, e.g. all those a build will create, before they exist.  Otherwise\n"
+          "        record the tilestacks found, and rerun after adding or removing tilestacks\n"
+          "--file-reader (stream|mmap|pread)\n"
+          "        Backend for reading tilestacks.  mmap reads uncompressed frames in place and decompresses\n"
+          "        from the mapping without an intermediate copy.  pread (not Windows) allows concurrent reads\n"
+          "        without locking, and batches requests through io_uring on Linux.  Default stream.\n"
+          "        Tilestacks and stacksets may also be named by URI:  file://path, http://host[:port]/path\n"
+          "        (Range requests; not Windows), or mem://path (read once into memory, e.g. for benchmarks)\n"
+          "--file-writer (stream|async)\n"
+          "        Backend for writing tilestacks (--save), kro tiles and PNGs.  async hands each 8 MB of output\n"
+          "        to a writer thread, so that e.g. compression continues while writing.  Default stream\n"
+          "--threads N\n"
+          "        Number of threads for parallel work, e.g. compressing frames in --save.  Default is the\n"
+          "        number of hardware threads\n"
+          "--cache-mb N\n"
+          "        Memory budget for computed and decoded frames, shared by all tilestacks.  Default 512\n"
+          "--compressed-cache-mb N\n"
+          "        Memory budget for the stored bytes of compressed frames read from tilestacks, from which\n"
+          "        frames evicted from the --cache-mb budget are decoded again without rereading.  0 disables.\n"
+          "        Default 256\n"
+          "--fadvise (off|on|drop-written)\n"
+          "        Page cache hints:  read ahead and sequential-scan hints for tilestacks and source images,\n"
+          "        and dropping deleted source tiles once read.  drop-written also drops each tilestack\n"
+          "        written by --save from the page cache (after writing it back).  Default on\n"
+          "--shm-cache N\n"
+          "        Share decoded frames of tilestacks loaded afterwards with other tilestacktool processes on\n"
+          "        this host, through N MB of POSIX shared memory per frame size.  Not Windows.  Default 0 (off)\n"
+          "--prefetch-mb N\n"
+          "        On sequential access to a tilestack, decode following frames in the background, keeping up\n"
+          "        to N MB of frames ahead across all tilestacks.  0 disables.  Default 64\n"
+          "--read-coalesce-kb N\n"
+          "        When frames of a tilestack are read sequentially, merge reads of adjacent frames into single\n"
+          "        reads of up to N KB.  0 disables.  Default 4096\n"
           "--loadraw file width height (uint8|uint16|uint32|float32|float64) channels\n"
           "--hblur sigma: gaussian blur horizontally\n"
           "--vblur sigma: gaussian blur vertically\n"
@@ -1573,9 +2718,49 @@ bool register_command(Command cmd) {
   return true;
 }
 
+// Fill FrameCache between decoding part of a banded frame and the whole frame, so that making room
+// for the whole frame would evict the partial decode it's finished from
+bool test_partial_frame_eviction() {
+  TilestackInfo ti;
+  ti.nframes = 2;
+  ti.tile_width = ti.tile_height = 64;
+  ti.bands_per_pixel = 3;
+  ti.bits_per_band = 8;
+  ti.pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
+  ti.compression_format = TilestackInfo::NO_COMPRESSION;
+  ResidentTilestack src(ti);
+  for (unsigned frame = 0; frame < ti.nframes; frame++) {
+    for (unsigned i = 0; i < ti.bytes_per_frame(); i++) src.frame_pixels(frame)[i] = (i / 5 + frame * 7) % 251;
+  }
+  TilestackWriteOptions options;
+  options.compression_format = TilestackInfo::ZLIB_BANDED_COMPRESSION;
+  options.band_height = 8;
+  MemoryWriter stored;
+  src.write(&stored, options);
+  MemoryFileReader::add("self-test/banded.ts2", stored.data);
+
+  size_t saved_budget = FrameCache::budget;
+  FrameCache::budget = ti.bytes_per_frame() * 5 / 2;
+  bool ok;
+  {
+    TilestackReader reader(simple_shared_ptr<Reader>(FileReader::open("mem://self-test/banded.ts2")));
+    reader.frame_rows(0, 0, 1);
+    reader.frame_pixels(1);
+    ok = !memcmp(reader.frame_pixels(0), src.frame_pixels(0), ti.bytes_per_frame()) &&
+         !memcmp(reader.frame_pixels(1), src.frame_pixels(1), ti.bytes_per_frame());
+  }
+  FrameCache::budget = saved_budget;
+  return ok;
+}
+
 bool self_test() {
   bool success = true;
   fprintf(stderr, "tilestacktool self-test: ");
+  {
+    bool partial_ok = test_partial_frame_eviction();
+    fprintf(stderr, "partial frame eviction %s;  ", partial_ok ? "success" : "FAIL");
+    success = success && partial_ok;
+  }
   {
     bool encoder_ok = H264Encoder::test() && VP8Encoder::test();
     fprintf(stderr, "%s\n", encoder_ok ? "success" : "FAIL");
@@ -1604,12 +2789,16 @@ int main(int argc, char **argv)
         ti.tile_width = args.shift_int();
         ti.tile_height = args.shift_int();
         {
-          // TODO: parse this correctly
-          if (args.shift() != "uint8") {
-            usage("Only supporting uint8 for raw input currently");
+          std::string type = args.shift();
+          if (type == "uint8" || type == "uint16" || type == "uint32") {
+            ti.bits_per_band = atoi(type.c_str() + 4);
+            ti.pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
+          } else if (type == "float32" || type == "float64") {
+            ti.bits_per_band = atoi(type.c_str() + 5);
+            ti.pixel_format = PixelInfo::PIXEL_FORMAT_FLOATING_POINT;
+          } else {
+            usage("--loadraw: unknown type '%s'", type.c_str());
           }
-          ti.bits_per_band = 8;
-          ti.pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
         }
         ti.bands_per_pixel = args.shift_int();
 
@@ -1624,7 +2813,8 @@ int main(int argc, char **argv)
         if (filename_suffix(dest) != "ts2") {
           usage("Filename to save should end in '.ts2'");
         }
-        save(dest);
+        JSON options = (args.next_is_non_flag()) ? args.shift_json() : JSON("{}");
+        save(dest, parse_write_options(options));
       }
       else if (arg == "--viz") {
         JSON params = args.shift_json();
@@ -1665,6 +2855,21 @@ int main(int argc, char **argv)
           codec = args.shift();
         write_video(dest, fps, compression, max_size, codec);
       }
+      else if (arg == "--image-scale") {
+        image_scale = args.shift_int();
+      }
+      else if (arg == "--image2tiles-all-levels") {
+        if (image2tiles_tile_rows) usage("--image2tiles-all-levels can't be combined with --image2tiles-tile-rows");
+        image2tiles_all_levels = true;
+      }
+      else if (arg == "--image2tiles-tile-rows") {
+        int first = args.shift_int(), end = args.shift_int();
+        if (first < 0 || end <= first) usage("--image2tiles-tile-rows: need 0 <= first < end");
+        if (image2tiles_all_levels) usage("--image2tiles-tile-rows can't be combined with --image2tiles-all-levels");
+        image2tiles_tile_rows = true;
+        image2tiles_first_tile_row = first;
+        image2tiles_end_tile_row = end;
+      }
       else if (arg == "--tilesize") {
         tilesize = args.shift_int();
       }
@@ -1693,6 +2898,18 @@ int main(int argc, char **argv)
 
         //delete_file(json_path.c_str());
         load_tiles(srcs);
+      } else if (arg == "--images2stacks") {
+        std::string dest = args.shift();
+        JSON options = (!args.empty() && args.front().substr(0,1) == "{") ? args.shift_json() : JSON("{}");
+        std::vector<std::string> srcs;
+        if (!args.empty() && args.front().substr(0,1) == "@") {
+          JSON list = JSON::fromFile(args.shift().substr(1));
+          for (unsigned i = 0; i < list["images"].size(); i++) srcs.push_back(list["images"][i].str());
+        } else {
+          while (!args.empty() && args.front().substr(0,1) != "-") srcs.push_back(args.shift());
+        }
+        if (srcs.empty()) usage("--images2stacks must have at least one source image");
+        images2stacks(dest, srcs, parse_write_options(options));
       } else if (arg == "--loadtiles") {
         std::vector<std::string> srcs;
         while (!args.empty() && args.front().substr(0,1) != "-") {
@@ -1704,6 +2921,9 @@ int main(int argc, char **argv)
         load_tiles(srcs);
         fprintf(stderr, "Loaded %d tiles\n", (int)srcs.size());
       }
+      else if (arg == "--pack-levels") {
+        pack_levels = true;
+      }
       else if (arg == "--delete-source-tiles") {
         delete_source_tiles = true;
       }
@@ -1748,6 +2968,48 @@ int main(int argc, char **argv)
         H264Encoder::ffmpeg_path_override = args.shift();
         VP8Encoder::ffmpeg_path_override = H264Encoder::ffmpeg_path_override;
       }
+      else if (arg == "--file-writer") {
+        FileWriter::select_opener(args.shift());
+      }
+      else if (arg == "--file-reader") {
+        FileReader::select_opener(args.shift());
+      }
+      else if (arg == "--threads") {
+        int nthreads = args.shift_int();
+        if (nthreads < 1) usage("--threads: must use at least 1 thread");
+        ThreadPool::set_default_size(nthreads);
+      }
+      else if (arg == "--cache-mb") {
+        int mb = args.shift_int();
+        if (mb < 0) usage("--cache-mb: must be non-negative");
+        FrameCache::budget = (size_t) mb * 1024 * 1024;
+      }
+      else if (arg == "--fadvise") {
+        std::string mode = args.shift();
+        if (mode != "off" && mode != "on" && mode != "drop-written") usage("--fadvise: unknown mode %s", mode.c_str());
+        FileAdvice::enabled = (mode != "off");
+        FileAdvice::drop_written = (mode == "drop-written");
+      }
+      else if (arg == "--shm-cache") {
+        int mb = args.shift_int();
+        if (mb < 0) usage("--shm-cache: must be non-negative");
+        SharedFrameCache::budget = (size_t) mb * 1024 * 1024;
+      }
+      else if (arg == "--compressed-cache-mb") {
+        int mb = args.shift_int();
+        if (mb < 0) usage("--compressed-cache-mb: must be non-negative");
+        CompressedFrameCache::budget = (size_t) mb * 1024 * 1024;
+      }
+      else if (arg == "--prefetch-mb") {
+        int mb = args.shift_int();
+        if (mb < 0) usage("--prefetch-mb: must be non-negative");
+        TilestackReader::prefetch_budget = (size_t) mb * 1024 * 1024;
+      }
+      else if (arg == "--read-coalesce-kb") {
+        int kb = args.shift_int();
+        if (kb < 0) usage("--read-coalesce-kb: window must be >= 0");
+        TilestackReader::coalesce_window = (size_t) kb * 1024;
+      }
       else if (arg == "--render-path") {
         render_js_path_override = args.shift();
       }
@@ -1839,6 +3101,10 @@ int main(int argc, char **argv)
         path2overlay(stack_width, stack_height, path,
                      overlay_html_path, warp_settings);
       }
+      else if (arg == "--write-tile-map") {
+        std::string stackset_path = args.shift();
+        write_tile_map(stackset_path, args.next_is_non_flag() ? args.shift() : "");
+      }
       else if (arg == "--createfile") {
         simple_shared_ptr<FileWriter> out(FileWriter::open(args.shift()));
       }
@@ -1860,6 +3126,14 @@ int main(int argc, char **argv)
     double user, system;
     get_cpu_usage(user, system);
     fprintf(stderr, "%s\n", TilestackReader::stats().c_str());
+    fprintf(stderr, "%s\n", FrameCache::stats().c_str());
+    fprintf(stderr, "%s\n", CompressedFrameCache::stats().c_str());
+    fprintf(stderr, "%s\n", FileAdvice::stats().c_str());
+#ifndef _WIN32
+    if (HttpFileReader::stats() != "") fprintf(stderr, "%s\n", HttpFileReader::stats().c_str());
+#endif
+    if (LevelPack::stats() != "") fprintf(stderr, "%s\n", LevelPack::stats().c_str());
+    if (SharedFrameCache::budget) fprintf(stderr, "%s\n", SharedFrameCache::stats().c_str());
     fprintf(stderr, "%s\n", Renderer::stats().c_str());
 
     fprintf(stderr, "User time %g, System time %g\n", user, system);
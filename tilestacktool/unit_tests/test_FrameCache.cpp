@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <string.h>
+
+#include "Tilestack.h"
+
+// Frames filled with their frame number
+class NumberedTilestack : public LRUTilestack {
+public:
+  mutable unsigned instantiations;
+  NumberedTilestack(unsigned nframes) : instantiations(0) {
+    tile_width = tile_height = 32;
+    bands_per_pixel = 1;
+    bits_per_band = 8;
+    pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
+    compression_format = 0;
+    set_nframes(nframes);
+  }
+  virtual void instantiate_pixels(unsigned frame) const {
+    create(frame);
+    memset(pixels[frame], frame, bytes_per_frame());
+    instantiations++;
+  }
+  unsigned resident() const {
+    unsigned n = 0;
+    for (unsigned i = 0; i < nframes; i++) n += pixels[i] != NULL;
+    return n;
+  }
+};
+
+int main(int argc, char **argv) {
+  NumberedTilestack stack(10);
+  FrameCache::budget = 3 * stack.bytes_per_frame();
+
+  // Top-level uses stay within the budget
+  for (unsigned i = 0; i < stack.nframes; i++) assert(stack.frame_pixels(i)[0] == i);
+  assert(stack.resident() == 3);
+
+  {
+    // A pinned frame survives other top-level uses, beyond the budget if need be
+    PinnedFrame pinned(stack, 0);
+    for (unsigned i = 1; i < stack.nframes; i++) stack.frame_pixels(i);
+    assert(stack.pixels[0] == pinned.pixels && pinned.pixels[stack.bytes_per_frame() - 1] == 0);
+    PinnedFrame pinned_again(stack, 0);
+    assert(pinned_again.pixels == pinned.pixels);
+  }
+
+  // Once unpinned, it's evicted as usual
+  for (unsigned i = 1; i < stack.nframes; i++) stack.frame_pixels(i);
+  assert(!stack.pixels[0]);
+  assert(stack.resident() == 3);
+  return 0;
+}
@@ -0,0 +1,140 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#include "FrameCodec.h"
+#include "mwc.h"
+
+TilestackInfo info(unsigned width, unsigned height, unsigned bands, unsigned bits, unsigned compression_format) {
+  TilestackInfo ti;
+  ti.nframes = 1;
+  ti.tile_width = width;
+  ti.tile_height = height;
+  ti.bands_per_pixel = bands;
+  ti.bits_per_band = bits;
+  ti.pixel_format = PixelInfo::PIXEL_FORMAT_INTEGER;
+  ti.compression_format = compression_format;
+  return ti;
+}
+
+std::vector<unsigned char> test_frame(const TilestackInfo &ti) {
+  // Smooth gradient plus noise, roughly like a photo
+  std::vector<unsigned char> frame(ti.bytes_per_frame());
+  MWC rand(0x12345678, 0x87654321);
+  for (unsigned i = 0; i < frame.size(); i++) frame[i] = (i / 7) % 200 + rand.get_byte() % 8;
+  return frame;
+}
+
+void test_roundtrip(const char *msg, const TilestackInfo &ti, const TilestackWriteOptions &options) {
+  std::vector<unsigned char> orig = test_frame(ti);
+  std::vector<unsigned char> encoded;
+  FrameCodec::encode(encoded, &orig[0], ti, options);
+  fprintf(stderr, "Testing FrameCodec %s.  %d bytes uncompressed.  %d bytes compressed (%.2f%%)\n",
+          msg, (int) orig.size(), (int) encoded.size(), 100.0 * encoded.size() / orig.size());
+
+  std::vector<unsigned char> decoded(orig.size());
+  FrameCodec::decode(&decoded[0], &encoded[0], encoded.size(), ti);
+  assert(decoded == orig);
+}
+
+int main(int argc, char **argv)
+{
+  TilestackWriteOptions options;
+
+  options.compression_format = TilestackInfo::NO_COMPRESSION;
+  test_roundtrip("none", info(64, 48, 3, 8, options.compression_format), options);
+
+  options.compression_format = TilestackInfo::ZLIB_COMPRESSION;
+  test_roundtrip("zlib", info(64, 48, 3, 8, options.compression_format), options);
+
+  options.compression_format = TilestackInfo::ZLIB_FILTERED_COMPRESSION;
+  test_roundtrip("zlib-filtered", info(64, 48, 3, 8, options.compression_format), options);
+  test_roundtrip("zlib-filtered 16-bit", info(64, 48, 1, 16, options.compression_format), options);
+
+  options.compression_format = TilestackInfo::ZLIB_COMPRESSION | TilestackInfo::SHUFFLE_FLAG;
+  test_roundtrip("zlib shuffled 16-bit", info(64, 48, 1, 16, options.compression_format), options);
+  test_roundtrip("zlib shuffled 64-bit", info(8, 48, 1, 64, options.compression_format), options);
+
+  {
+    // Delta frames reconstruct exactly, including floating point
+    options.compression_format = TilestackInfo::ZLIB_DELTA_COMPRESSION;
+    TilestackInfo ti = info(16, 16, 1, 32, options.compression_format);
+    ti.pixel_format = PixelInfo::PIXEL_FORMAT_FLOATING_POINT;
+    std::vector<float> frame0(256), frame1(256);
+    for (unsigned i = 0; i < 256; i++) {
+      frame0[i] = i * 0.37f;
+      frame1[i] = (i % 5) ? frame0[i] : -frame0[i] - 1e-20f;
+    }
+    std::vector<unsigned char> key, delta;
+    FrameCodec::encode(key, (unsigned char*) &frame0[0], ti, options);
+    FrameCodec::encode(delta, (unsigned char*) &frame1[0], ti, options, (unsigned char*) &frame0[0]);
+    fprintf(stderr, "Testing FrameCodec zlib-delta.  Keyframe %d bytes, delta frame %d bytes\n",
+            (int) key.size(), (int) delta.size());
+    assert(FrameCodec::is_temporal(ti));
+    assert(FrameCodec::keyframe_interval(&delta[0], delta.size()) == options.keyframe_interval);
+
+    std::vector<float> decoded0(256), decoded1(256);
+    FrameCodec::decode((unsigned char*) &decoded0[0], &key[0], key.size(), ti);
+    FrameCodec::decode((unsigned char*) &decoded1[0], &delta[0], delta.size(), ti, (unsigned char*) &decoded0[0]);
+    assert(!memcmp(&decoded0[0], &frame0[0], 256 * sizeof(float)));
+    assert(!memcmp(&decoded1[0], &frame1[0], 256 * sizeof(float)));
+
+    ti.compression_format = options.compression_format |= TilestackInfo::SHUFFLE_FLAG;
+    assert(FrameCodec::is_temporal(ti));
+    FrameCodec::encode(delta, (unsigned char*) &frame1[0], ti, options, (unsigned char*) &frame0[0]);
+    FrameCodec::decode((unsigned char*) &decoded1[0], &delta[0], delta.size(), ti, (unsigned char*) &decoded0[0]);
+    assert(!memcmp(&decoded1[0], &frame1[0], 256 * sizeof(float)));
+  }
+
+  options.compression_format = TilestackInfo::ZLIB_BANDED_COMPRESSION;
+  options.band_height = 10;
+  test_roundtrip("zlib-banded", info(64, 48, 3, 8, options.compression_format), options);
+
+  {
+    // JPEG is lossy;  check the decoded frame stays close to the original
+    options.compression_format = TilestackInfo::JPEG_COMPRESSION;
+    options.jpeg_quality = 95;
+    TilestackInfo ti = info(64, 48, 3, 8, options.compression_format);
+    assert(FrameCodec::is_lossy(ti));
+    std::vector<unsigned char> orig = test_frame(ti);
+    std::vector<unsigned char> encoded;
+    FrameCodec::encode(encoded, &orig[0], ti, options);
+    std::vector<unsigned char> decoded(orig.size());
+    FrameCodec::decode(&decoded[0], &encoded[0], encoded.size(), ti);
+    double total_error = 0;
+    for (unsigned i = 0; i < orig.size(); i++) total_error += abs((int) decoded[i] - (int) orig[i]);
+    fprintf(stderr, "Testing FrameCodec jpeg.  %d bytes compressed.  Mean error %.2f\n",
+            (int) encoded.size(), total_error / orig.size());
+    assert(total_error / orig.size() < 4);
+
+    // Only 8-bit, 1 or 3 band stacks can be JPEG-compressed
+    bool threw = false;
+    try {
+      FrameCodec::encode(encoded, &orig[0], info(32, 48, 1, 16, options.compression_format), options);
+    } catch (std::runtime_error &e) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  options.compression_format = TilestackInfo::ZLIB_BANDED_COMPRESSION;
+  {
+    // Decoding one band touches only its rows
+    TilestackInfo ti = info(64, 48, 3, 8, options.compression_format);
+    std::vector<unsigned char> orig = test_frame(ti);
+    std::vector<unsigned char> encoded;
+    FrameCodec::encode(encoded, &orig[0], ti, options);
+    assert(FrameCodec::decodes_bands(ti));
+    assert(FrameCodec::band_height(&encoded[0], encoded.size()) == 10);
+
+    size_t bytes_per_row = ti.bytes_per_pixel() * ti.tile_width;
+    std::vector<unsigned char> decoded(orig.size(), 0);
+    FrameCodec::decode_band(&decoded[0], 4, &encoded[0], encoded.size(), ti); // last band, rows 40-47
+    assert(!memcmp(&decoded[40 * bytes_per_row], &orig[40 * bytes_per_row], 8 * bytes_per_row));
+    assert(std::vector<unsigned char>(&decoded[0], &decoded[40 * bytes_per_row]) ==
+           std::vector<unsigned char>(40 * bytes_per_row, 0));
+  }
+  return 0;
+}
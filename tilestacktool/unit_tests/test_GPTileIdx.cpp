@@ -1,5 +1,7 @@
 #include <assert.h>
 
+#include <stdexcept>
+
 #include "GPTileIdx.h"
 
 int main(int argc, char **argv) {
@@ -23,5 +25,17 @@ int main(int argc, char **argv) {
   assert(GPTileIdx(6,42,12).basename() == "r103210");
   assert(GPTileIdx(6,42,12).path() == "r10/321/r103210");
 
+  std::string root;
+  GPTileIdx parsed = GPTileIdx::from_path("/data/stack/r10/321/r103210.ts2", ".ts2", root);
+  assert(parsed.level == 6 && parsed.x == 42 && parsed.y == 12 && root == "/data/stack");
+  assert(GPTileIdx::from_path("stack/r.ts2", ".ts2", root).level == 0 && root == "stack");
+  bool threw = false;
+  try {
+    GPTileIdx::from_path("/data/stack/r103210.ts2", ".ts2", root);
+  } catch (std::runtime_error &e) {
+    threw = true;
+  }
+  assert(threw);
+
   return 0;
 }
@@ -0,0 +1,83 @@
+#include <assert.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "io.h"
+#include "LevelPack.h"
+#include "simple_shared_ptr.h"
+
+std::vector<unsigned char> contents(unsigned char fill, size_t length) {
+  return std::vector<unsigned char>(length, fill);
+}
+
+void append(const std::string &path, unsigned long long idx, const std::vector<unsigned char> &data) {
+  LevelPackWriter out(path, idx);
+  out.write(&data[0], data.size());
+  out.close();
+}
+
+std::vector<unsigned char> lookup(const std::string &path, unsigned long long idx) {
+  LevelPack pack(simple_shared_ptr<Reader>(FileReader::open(path)), path);
+  simple_shared_ptr<Reader> r(pack.open(idx));
+  if (!r.get()) return std::vector<unsigned char>();
+  return r->read(0, r->length());
+}
+
+int main(int argc, char **argv) {
+#ifndef _WIN32
+  std::string path = temporary_path("unit_tests/test_LevelPack.tspack");
+
+  // Out of order appends;  the index is sorted
+  append(path, 30, contents(3, 3000));
+  append(path, 10, contents(1, 1000));
+  append(path, 20, contents(2, 2000));
+  assert(lookup(path, 10) == contents(1, 1000));
+  assert(lookup(path, 20) == contents(2, 2000));
+  assert(lookup(path, 30) == contents(3, 3000));
+  assert(lookup(path, 15).empty());
+
+  // Replacing keeps one entry per idx
+  append(path, 20, contents(4, 500));
+  {
+    LevelPack pack(simple_shared_ptr<Reader>(FileReader::open(path)), path);
+    assert(pack.size() == 3);
+  }
+  assert(lookup(path, 20) == contents(4, 500));
+
+  // An abandoned append leaves the pack as it was
+  {
+    LevelPackWriter out(path, 40);
+    out.write(&contents(5, 100)[0], 100);
+  }
+  assert(lookup(path, 40).empty());
+  assert(lookup(path, 30) == contents(3, 3000));
+
+  // Lose the footer, as if interrupted;  readers fail, and the next append recovers the entries
+  {
+    simple_shared_ptr<Reader> r(FileReader::open(path));
+    size_t length = r->length();
+    r.reset(NULL);
+    assert(truncate(path.c_str(), length - 10) == 0);
+  }
+  bool threw = false;
+  try {
+    lookup(path, 10);
+  } catch (std::runtime_error &e) {
+    threw = true;
+  }
+  assert(threw);
+  append(path, 50, contents(6, 600));
+  assert(lookup(path, 10) == contents(1, 1000));
+  assert(lookup(path, 20) == contents(4, 500));
+  assert(lookup(path, 50) == contents(6, 600));
+
+  delete_file(path);
+#endif
+  return 0;
+}
@@ -0,0 +1,49 @@
+#include <assert.h>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <vector>
+
+#include "SharedFrameCache.h"
+#include "mwc.h"
+
+int main(int argc, char **argv) {
+#ifndef _WIN32
+  // Unusual budget and frame size, so as not to share a segment with real runs
+  SharedFrameCache::budget = 3 * 1024 * 1024 + 17;
+  std::vector<unsigned char> frame(100003);
+  MWC rand(0x12345678, 0x87654321);
+  for (unsigned i = 0; i < frame.size(); i++) frame[i] = rand.get_byte();
+  std::string key = "/no/such/file.ts2:1:2:3";
+  std::vector<unsigned char> found(frame.size());
+  assert(!SharedFrameCache::lookup(key, 7, &found[0], found.size()));
+
+  // Insert in a child process, and find the frame in the parent
+  pid_t child = fork();
+  if (child == 0) {
+    SharedFrameCache::insert(key, 7, &frame[0], frame.size());
+    _exit(0);
+  }
+  int status;
+  waitpid(child, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(SharedFrameCache::lookup(key, 7, &found[0], found.size()));
+  assert(found == frame);
+  assert(!SharedFrameCache::lookup(key, 8, &found[0], found.size()));
+  assert(!SharedFrameCache::lookup("/no/such/file.ts2:1:2:4", 7, &found[0], found.size()));
+
+  // Fill well beyond capacity;  the cache keeps working, evicting old frames
+  for (unsigned i = 0; i < 100; i++) {
+    frame[0] = i;
+    SharedFrameCache::insert(key, 100 + i, &frame[0], frame.size());
+  }
+  assert(SharedFrameCache::lookup(key, 199, &found[0], found.size()));
+  assert(found == frame);
+
+  SharedFrameCache::remove();
+#endif
+  return 0;
+}
@@ -12,6 +12,11 @@ void test(const char *msg, const std::vector<unsigned char> &orig) {
   std::vector<unsigned char> uncompressed;
   Zlib::uncompress(uncompressed, &compressed[0], compressed.size());
   assert(orig == uncompressed);
+
+  std::vector<unsigned char> in_place(orig.size());
+  size_t len = Zlib::uncompress(in_place.empty() ? NULL : &in_place[0], in_place.size(), &compressed[0], compressed.size());
+  assert(len == orig.size());
+  assert(orig == in_place);
 }
 
 int main(int argc, char **argv)
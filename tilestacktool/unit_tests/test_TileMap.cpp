@@ -0,0 +1,36 @@
+#include <assert.h>
+
+#include <stdexcept>
+
+#include "TileMap.h"
+
+int main(int argc, char **argv) {
+  // 1100 x 600 pixels of 256 x 256 tiles:  base level 5 x 3 tiles, then 3 x 2, 2 x 1, 1 x 1
+  TileMap map(4, 1100, 600, 256, 256);
+  assert(map.cols(3) == 5 && map.rows(3) == 3);
+  assert(map.cols(2) == 3 && map.rows(2) == 2);
+  assert(map.cols(1) == 2 && map.rows(1) == 1);
+  assert(map.cols(0) == 1 && map.rows(0) == 1);
+  assert(map.count() == 0);
+  map.set(3, 4, 2);
+  map.set(2, 0, 1);
+  map.set(0, 0, 0);
+
+  TileMap copy(map.serialize());
+  assert(copy.count() == 3);
+  assert(copy.exists(3, 4, 2) && copy.exists(2, 0, 1) && copy.exists(0, 0, 0));
+  assert(!copy.exists(3, 3, 2) && !copy.exists(2, 1, 0) && !copy.exists(1, 0, 0));
+  // Outside the grid, or the pyramid
+  assert(!copy.exists(3, 5, 2) && !copy.exists(3, -1, 0) && !copy.exists(4, 0, 0));
+
+  std::vector<unsigned char> truncated = map.serialize();
+  truncated.pop_back();
+  bool threw = false;
+  try {
+    TileMap bad(truncated);
+  } catch (std::runtime_error &e) {
+    threw = true;
+  }
+  assert(threw);
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+
+#include "io.h"
+#include "io_asyncfile.h"
+#include "io_httpfile.h"
+#include "io_memfile.h"
+#include "io_mmapfile.h"
+#include "io_preadfile.h"
+#include "io_streamfile.h"
+#include "mwc.h"
+#include "simple_shared_ptr.h"
+
+#ifndef _WIN32
+// Minimal HTTP/1.1 server answering Range requests for data, one connection at a time, with keep-alive
+void serve_ranges(int listener, const std::vector<unsigned char> &data) {
+  while (1) {
+    int conn = accept(listener, NULL, NULL);
+    if (conn < 0) continue;
+    std::string request;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(conn, buf, sizeof(buf), 0)) > 0) {
+      request.append(buf, n);
+      size_t end;
+      while ((end = request.find("\r\n\r\n")) != std::string::npos) {
+        std::string headers = request.substr(0, end);
+        request.erase(0, end + 4);
+        size_t first = 0, last = data.size() - 1;
+        const char *range = strstr(headers.c_str(), "Range: bytes=");
+        if (range && range[13] == '-') {
+          first = data.size() - std::min(data.size(), (size_t) atoll(range + 14));
+        } else if (range) {
+          sscanf(range + 13, "%zu-%zu", &first, &last);
+        }
+        last = std::min(last, data.size() - 1);
+        std::string response = string_printf("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\n"
+                                             "Content-Length: %zu\r\n\r\n", first, last, data.size(), last + 1 - first);
+        response.append((const char*) &data[first], last + 1 - first);
+        send(conn, response.data(), response.size(), 0);
+      }
+    }
+    close(conn);
+  }
+}
+#endif
+
+int main(int argc, char **argv) {
+  std::string path = temporary_path("unit_tests/test_io.dat");
+  std::vector<unsigned char> data(1000000);
+  MWC rand(0x12345678, 0x87654321);
+  for (unsigned i = 0; i < data.size(); i++) data[i] = rand.get_byte();
+  {
+    simple_shared_ptr<Writer> out(FileWriter::open(path));
+    out->write(data);
+  }
+
+  {
+    simple_shared_ptr<Reader> stream(new StreamFileReader(path));
+    assert(stream->length() == data.size());
+    assert(!stream->map(0, 10));
+    assert(stream->read(12345, 100) == std::vector<unsigned char>(&data[12345], &data[12345 + 100]));
+  }
+
+#ifndef _WIN32
+  {
+    FileReader::select_opener("mmap");
+    simple_shared_ptr<Reader> mapped(FileReader::open(path));
+    FileReader::select_opener("stream");
+    assert(dynamic_cast<MmapFileReader*>(mapped.get()));
+    assert(mapped->length() == data.size());
+    assert(mapped->read(0, data.size()) == data);
+    const unsigned char *ptr = mapped->map(999000, 1000);
+    assert(ptr && std::vector<unsigned char>(ptr, ptr + 1000) == std::vector<unsigned char>(&data[999000], &data[1000000]));
+    bool threw = false;
+    try {
+      mapped->map(999000, 1001);
+    } catch (std::runtime_error &e) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  {
+    FileReader::select_opener("pread");
+    simple_shared_ptr<Reader> pread_reader(FileReader::open(path));
+    FileReader::select_opener("stream");
+    assert(pread_reader->thread_safe());
+    assert(pread_reader->length() == data.size());
+    assert(pread_reader->read(0, data.size()) == data);
+
+    // More requests than the io_uring ring holds, at scattered offsets
+    std::vector<unsigned char> batched(data.size());
+    std::vector<Reader::ReadRequest> requests;
+    for (size_t pos = 0; pos < data.size(); pos += 997) {
+      size_t len = std::min((size_t) 997, data.size() - pos);
+      requests.push_back(Reader::ReadRequest(&batched[pos], pos, len));
+    }
+    std::reverse(requests.begin(), requests.end());
+    pread_reader->read_batch(requests);
+    assert(batched == data);
+
+    bool threw = false;
+    try {
+      pread_reader->read(999000, 1001);
+    } catch (std::runtime_error &e) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    assert(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(listener, 4) == 0);
+    assert(getsockname(listener, (struct sockaddr*) &addr, &addrlen) == 0);
+    pid_t server = fork();
+    if (server == 0) serve_ranges(listener, data);
+    close(listener);
+
+    simple_shared_ptr<Reader> http(FileReader::open(string_printf("http://127.0.0.1:%d/test_io.dat", ntohs(addr.sin_port))));
+    assert(http->length() == data.size());
+    // Footer-like read at the end is served from the response to opening
+    assert(http->read(data.size() - 48, 48) == std::vector<unsigned char>(&data[data.size() - 48], &data[data.size()]));
+    assert(http->read(12345, 100) == std::vector<unsigned char>(&data[12345], &data[12345 + 100]));
+    std::vector<unsigned char> batched(data.size());
+    std::vector<Reader::ReadRequest> requests;
+    for (size_t pos = 0; pos < data.size(); pos += 9973) {
+      requests.push_back(Reader::ReadRequest(&batched[pos], pos, std::min((size_t) 9000, data.size() - pos)));
+    }
+    std::reverse(requests.begin(), requests.end());
+    http->read_batch(requests);
+    for (size_t pos = 0; pos < data.size(); pos += 9973) {
+      size_t len = std::min((size_t) 9000, data.size() - pos);
+      assert(std::equal(&batched[pos], &batched[pos] + len, &data[pos]));
+    }
+    // Another reader of the same host reuses the pooled connection;  the server accepts only one at a time
+    simple_shared_ptr<Reader> http2(FileReader::open(string_printf("http://127.0.0.1:%d/other.dat", ntohs(addr.sin_port))));
+    assert(http2->read(500000, 100) == std::vector<unsigned char>(&data[500000], &data[500000 + 100]));
+    assert(HttpFileReader::stats().find("over 1 connections") != std::string::npos);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+  }
+#endif
+
+  {
+    simple_shared_ptr<Reader> memory(FileReader::open("mem://" + path));
+    assert(memory->read(0, data.size()) == data);
+    assert(memory->map(999000, 1000) && !memcmp(memory->map(999000, 1000), &data[999000], 1000));
+    MemoryFileReader::add("test", std::vector<unsigned char>(10, 7));
+    simple_shared_ptr<Reader> added(FileReader::open("mem://test"));
+    assert(added->read(3, 2) == std::vector<unsigned char>(2, 7));
+    simple_shared_ptr<Reader> file_uri(FileReader::open("file://" + path));
+    assert(file_uri->length() == data.size());
+  }
+
+  {
+    // Several handoffs to the writer thread, in pieces that straddle buffers
+    AsyncFileWriter::buffer_size = 65536;
+    FileWriter::select_opener("async");
+    simple_shared_ptr<FileWriter> out(FileWriter::open(path));
+    FileWriter::select_opener("stream");
+    for (size_t pos = 0; pos < data.size(); pos += 30000) {
+      out->write(&data[pos], std::min((size_t) 30000, data.size() - pos));
+    }
+    out->close();
+    simple_shared_ptr<Reader> in(FileReader::open(path));
+    assert(in->read(0, in->length()) == data);
+  }
+
+  delete_file(path);
+  return 0;
+}